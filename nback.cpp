@@ -1,25 +1,84 @@
 
 
+// the self-tests are asserts, so the test build always has them
+#ifdef NBACK_UNIT_TESTS
+#undef NDEBUG
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <fcntl.h>
 #include <getopt.h>
+#include <memory>
+#include <mutex>
 #include <new>
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define NBACK_HAS_COROUTINES
+#include <coroutine>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#define NBACK_HAS_LANE_KERNELS
+#endif
+// loops in constexpr functions need C++14. older builds get plain inline
+// functions and skip the compile-time checks
+#if defined(__cpp_constexpr) && __cpp_constexpr >= 201304L
+#define NBACK_CONSTEXPR constexpr
+#define NBACK_HAS_CONSTEXPR_RING
+#else
+#define NBACK_CONSTEXPR inline
+#endif
+// fixed trip count loops over a history, unrolled in every instantiation
+#if defined(__clang__)
+#define NBACK_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define NBACK_UNROLL _Pragma("GCC unroll 64")
+#else
+#define NBACK_UNROLL
+#endif
 
 template<typename t_type, int size>
 class ring_t {
 private:
 	class c_const_iterator_base {
 		protected:
-			c_const_iterator_base(const ring_t<t_type, size> *source)
+			NBACK_CONSTEXPR c_const_iterator_base(const ring_t<t_type, size> *source)
 				: m_source(source), m_inc(0) { }
 		public:
-			inline bool is_valid() const { return m_inc < m_source->count; }
-			inline void next() {
+			NBACK_CONSTEXPR bool is_valid() const { return m_inc < m_source->count; }
+			NBACK_CONSTEXPR void next() {
 				if (is_valid()) {
 					++m_inc;
 				}
@@ -32,63 +91,69 @@ private:
 public:
 	enum { my_size= size };
 
-	ring_t() : head_index(-1), tail_index(0), count(0) {}
+	// data is zeroed only because a constexpr constructor must initialize it
+	NBACK_CONSTEXPR ring_t() : head_index(-1), tail_index(0), count(0), data() {}
 
 	// accessors
 
-	inline int get_count() const {
+	NBACK_CONSTEXPR int get_count() const {
 		return count;
 	}
 
-	inline bool is_empty() const { return head_index==-1; }
-	inline bool is_full() const {
+	NBACK_CONSTEXPR bool is_empty() const { return head_index==-1; }
+	NBACK_CONSTEXPR bool is_full() const {
 		return !is_empty() && (head_index + 1)%size==tail_index;
 	}
 
+	// the value 'back' places behind the newest, 0 <= back < get_count()
+	NBACK_CONSTEXPR const t_type &get_back(int back) const {
+		return data[head_index >= back ? head_index - back : head_index - back + size];
+	}
+
 	class c_const_iterator : public c_const_iterator_base {
 		typedef c_const_iterator_base base;
 		public:
-			c_const_iterator(const ring_t<t_type, size> *source) : base(source) {}
-			inline int get_data_index() const {
+			NBACK_CONSTEXPR c_const_iterator(const ring_t<t_type, size> *source) : base(source) {}
+			NBACK_CONSTEXPR int get_data_index() const {
 				const int tail= base::m_source->tail_index;
 				return (tail+base::m_inc) % size;
 			}
-			inline const t_type &get() const {
+			NBACK_CONSTEXPR const t_type &get() const {
 				return base::m_source->data[get_data_index()];
 			}
 			
 	};
 
-	c_const_iterator iterate() const {
+	NBACK_CONSTEXPR c_const_iterator iterate() const {
 		return c_const_iterator(this);
 	}
 
 	class c_const_reverse_iterator : public c_const_iterator_base {
 		private:
 			typedef c_const_iterator_base base;
-			inline int get_virtual_head() const {
+			NBACK_CONSTEXPR int get_virtual_head() const {
 				return base::m_source->head_index < base::m_source->tail_index
 					? base::m_source->head_index + size
 					: base::m_source->head_index;
 			}
 		public:
-			c_const_reverse_iterator(const ring_t<t_type, size> *source) : base(source) {}
-			inline int get_data_index() const {
+			NBACK_CONSTEXPR c_const_reverse_iterator(const ring_t<t_type, size> *source) : base(source) {}
+			NBACK_CONSTEXPR int get_data_index() const {
 				const int virtual_head= get_virtual_head();
 				return (virtual_head-base::m_inc) % size;
 			}
-			inline const t_type &get() const {
+			NBACK_CONSTEXPR const t_type &get() const {
 				return base::m_source->data[get_data_index()];
 			}
 	};
 
-	c_const_reverse_iterator iterate_reverse() const {
+	NBACK_CONSTEXPR c_const_reverse_iterator iterate_reverse() const {
 		return c_const_reverse_iterator(this);
 	}
 
 	// mutators
 
-	void enqueue(const t_type &other) {
+	NBACK_CONSTEXPR void enqueue(const t_type &other) {
 		assert(tail_index>= 0 && tail_index < size);
 		assert(head_index < size);
 		assert(get_count() < size);
@@ -99,7 +164,7 @@ public:
 		data[head_index]= other;
 	}
 
-	const t_type &dequeue() {
+	NBACK_CONSTEXPR const t_type &dequeue() {
 		assert(tail_index>= 0 && tail_index < size);
 		assert(head_index < size);
 		assert(get_count() > 0);
@@ -116,7 +181,7 @@ public:
 		return data[old_tail_index];
 	}
 
-	inline void clear() {
+	NBACK_CONSTEXPR void clear() {
 		count= 0;
 		tail_index= 0;
 		head_index= -1;
@@ -129,6 +194,7 @@ private:
 	t_type data[size];
 };
 
+#ifdef NBACK_UNIT_TESTS
 void run_unit_tests_ring_t() {
 
 	typedef ring_t<int, 5> test_ring_t;
@@ -165,6 +231,7 @@ void run_unit_tests_ring_t() {
 		assert(it_count==test.get_count());
 	}
 }
+#endif // NBACK_UNIT_TESTS
 
 template<typename t_type>
 struct optional {
@@ -174,72 +241,674 @@ struct optional {
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
 
+// Random numbers
+
+// xorshift64*. cheap enough for millions of simulated sessions, and every
+// session can own an independent, reproducible stream.
+class nback_rng {
+public:
+	NBACK_CONSTEXPR explicit nback_rng(uint64_t seed= 1) : m_state(1) {
+		reseed(seed);
+	}
+
+	// splitmix64 of the seed, so nearby seeds give unrelated streams
+	static NBACK_CONSTEXPR uint64_t mix(uint64_t x) {
+		x+= 0x9e3779b97f4a7c15ull;
+		x= (x ^ (x >> 30))*0xbf58476d1ce4e5b9ull;
+		x= (x ^ (x >> 27))*0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	NBACK_CONSTEXPR void reseed(uint64_t seed) {
+		m_state= mix(seed);
+		if (m_state == 0) {
+			m_state= 1;
+		}
+	}
+
+	NBACK_CONSTEXPR uint64_t next() {
+		return advance(m_state);
+	}
+
+	// [0, bound), multiply-shift instead of a division
+	NBACK_CONSTEXPR uint32_t next_below(uint32_t bound) {
+		return scale(next(), bound);
+	}
+
+	// the same steps on a bare state, for generators kept in arrays
+	static NBACK_CONSTEXPR uint64_t advance(uint64_t &state) {
+		state^= state >> 12;
+		state^= state << 25;
+		state^= state >> 27;
+		return state*0x2545f4914f6cdd1dull;
+	}
+
+	static NBACK_CONSTEXPR uint32_t scale(uint64_t bits, uint32_t bound) {
+		return (uint32_t)(((bits >> 32)*bound) >> 32);
+	}
+
+	inline uint64_t get_state() const { return m_state; }
+	inline void set_state(uint64_t state) { m_state= state; }
+
+private:
+	uint64_t m_state;
+};
+
 //TODO: type-generic shuffle, at least other integral types
-void shuffle_ints(int *array, size_t n) {
+template<typename t_value>
+void shuffle_values(t_value *array, size_t n, nback_rng &rng) {
 	if (n > 1) {
 		size_t i;
 		for (i = 0; i < n - 1; i++) {
-			size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
+			size_t j = i + rng.next_below((uint32_t)(n - i));
 			assert(j < n);
-			int t = array[j];
+			t_value t = array[j];
 			array[j] = array[i];
 			array[i] = t;
 		}
 	}
 }
 
+// Session memory
+
+// heap allocations made by the calling thread through operator new, so that
+// a loop can show it allocates nothing
+thread_local long long heap_allocation_count= 0;
+
+void *operator new(size_t size) {
+	++heap_allocation_count;
+	void *memory= malloc(size ? size : 1);
+	if (!memory) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+// gcc 11+ reports free() here as mismatched once it is inlined next to the
+// replaced operator new above, which is the pairing it is meant to have
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *memory) noexcept {
+	free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+	free(memory);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+#ifdef __cpp_aligned_new
+void *operator new(size_t size, std::align_val_t alignment) {
+	++heap_allocation_count;
+	void *memory= 0;
+	if (posix_memalign(&memory, std::max(sizeof(void*), (size_t)alignment), size ? size : 1) != 0) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept {
+	free(memory);
+}
+
+void operator delete(void *memory, size_t, std::align_val_t) noexcept {
+	free(memory);
+}
+#endif // __cpp_aligned_new
+
+// A bump allocator for everything that lives exactly as long as a session.
+// Objects are carved out of one mapping and released all at once by
+// rewind() or reset(), without running destructors, so only types that own
+// no resources belong in here. Huge pages are asked for with MAP_HUGETLB
+// first, then as a transparent huge page hint.
+class session_arena {
+public:
+	enum e_pages {
+		pages_normal,
+		pages_transparent_huge,
+		pages_huge
+	};
+
+	session_arena() : m_base(0), m_capacity(0), m_used(0), m_pages(pages_normal) {}
+
+	~session_arena() {
+		release();
+	}
+
+	bool open(size_t capacity, bool huge_pages) {
+		const size_t huge_page_size= 2*1024*1024;
+
+		release();
+		if (huge_pages) {
+			capacity= (capacity + huge_page_size - 1) & ~(huge_page_size - 1);
+			m_base= map(capacity, MAP_HUGETLB);
+			m_pages= pages_huge;
+		}
+		if (!m_base) {
+			m_base= map(capacity, 0);
+			m_pages= pages_normal;
+#ifdef MADV_HUGEPAGE
+			if (m_base && huge_pages && madvise(m_base, capacity, MADV_HUGEPAGE) == 0) {
+				m_pages= pages_transparent_huge;
+			}
+#endif
+		}
+		if (!m_base) {
+			return false;
+		}
+
+		m_capacity= capacity;
+		m_used= 0;
+		return true;
+	}
+
+	void release() {
+		if (m_base) {
+			munmap(m_base, m_capacity);
+		}
+		m_base= 0;
+		m_capacity= 0;
+		m_used= 0;
+	}
+
+	// 0 when the arena is full
+	void *allocate(size_t size, size_t alignment) {
+		const size_t start= (m_used + alignment - 1) & ~(alignment - 1);
+		if (start + size > m_capacity) {
+			return 0;
+		}
+		m_used= start + size;
+		return m_base + start;
+	}
+
+	template <typename t_type>
+	t_type *create() {
+		void *memory= allocate(sizeof(t_type), alignof(t_type));
+		return memory ? new(memory) t_type : 0;
+	}
+
+	template <typename t_type, typename t_arg>
+	t_type *create(t_arg &arg) {
+		void *memory= allocate(sizeof(t_type), alignof(t_type));
+		return memory ? new(memory) t_type(arg) : 0;
+	}
+
+	template <typename t_type, typename t_arg, typename t_arg2>
+	t_type *create(t_arg &arg, const t_arg2 &arg2) {
+		void *memory= allocate(sizeof(t_type), alignof(t_type));
+		return memory ? new(memory) t_type(arg, arg2) : 0;
+	}
+
+	template <typename t_type>
+	t_type *create_array(size_t count) {
+		t_type *array= (t_type *)allocate(count*sizeof(t_type), alignof(t_type));
+		for (size_t i= 0; array && i < count; ++i) {
+			new(&array[i]) t_type;
+		}
+		return array;
+	}
+
+	// everything allocated since get_used() returned mark is gone
+	inline void rewind(size_t mark) {
+		assert(mark <= m_used);
+		m_used= mark;
+	}
+
+	inline void reset() { m_used= 0; }
+	inline size_t get_used() const { return m_used; }
+	inline size_t get_capacity() const { return m_capacity; }
+	inline e_pages get_pages() const { return m_pages; }
+
+	const char *get_pages_name() const {
+		switch (m_pages) {
+			case pages_huge: return "huge";
+			case pages_transparent_huge: return "transparent huge";
+			default: return "normal";
+		}
+	}
+
+private:
+	session_arena(const session_arena &);
+	session_arena &operator=(const session_arena &);
+
+	static unsigned char *map(size_t capacity, int extra_flags) {
+		void *memory= mmap(0, capacity, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+		return memory == MAP_FAILED ? 0 : (unsigned char *)memory;
+	}
+
+	unsigned char *m_base;
+	size_t m_capacity;
+	size_t m_used;
+	e_pages m_pages;
+};
+
+// room for the provider, history and small buffers of one session
+const size_t session_arena_slack= 64*1024;
+
 // Nback logic
 
 typedef ring_t<int, 7> n_back_buffer;
 
-bool nback_is_guess_correct(const n_back_buffer &past, int guess_back) {
-	bool result= false;
+// --max_n goes up to this; every depth has a session instantiated for it,
+// see run_terminal_session
+const int max_session_n= 16;
+
+// deepest n of all, see Occurrence masks
+const int max_deep_n= 64;
+
+// Stimulus values run 1..get_symbol_count(max_n): 1..10 up to n 6, then a
+// wider range the deeper the session, so that about as many trials have an
+// n-back at any depth (45 to 47%) and the card deck, four of each value,
+// always outlasts the history.
+constexpr int get_symbol_count(int max_n) {
+	return (5*max_n + 2)/3 > 10 ? (5*max_n + 2)/3 : 10;
+}
+
+const int max_symbol_count= get_symbol_count(max_deep_n);
+static_assert(get_symbol_count(6) == 10, "the default game deals values 1..10");
+
+// Every n at which the head value appeared before, bit n-1 for n, from one
+// pass over the history. The loop runs over the ring's fixed size, so each
+// history depth gets its own unrolled (and often vectorized) compare;
+// entries past get_count() are masked off. The predicates below are all
+// views of this mask, so a trial evaluates its history once and keeps the
+// mask (see nback_push_value).
+template<typename t_history>
+NBACK_CONSTEXPR uint64_t nback_match_mask(const t_history &past) {
+	static_assert(t_history::my_size - 1 <= max_deep_n, "a mask holds 64 positions");
+	uint64_t matches= 0;
+
+	if (!past.is_empty()) {
+		const int count= past.get_count();
+		const int head_value= past.get_back(0);
+
+		NBACK_UNROLL
+		for (int back= 1; back < t_history::my_size; ++back) {
+			const bool match= back < count && past.get_back(back) == head_value;
+			matches|= (uint64_t)match << (back - 1);
+		}
+	}
+
+	return matches;
+}
+
+NBACK_CONSTEXPR bool nback_mask_is_guess_correct(uint64_t matches, int guess_back) {
+	return guess_back >= 1 && guess_back <= max_deep_n && ((matches >> (guess_back - 1)) & 1) != 0;
+}
+
+// the smallest n at which the head value appeared before, 0 if none
+NBACK_CONSTEXPR int nback_mask_nearest_back(uint64_t matches) {
+	return matches ? __builtin_ctzll(matches) + 1 : 0;
+}
+
+template<typename t_history>
+NBACK_CONSTEXPR bool nback_is_guess_correct(const t_history &past, int guess_back) {
+	return nback_mask_is_guess_correct(nback_match_mask(past), guess_back);
+}
+
+template<typename t_history>
+NBACK_CONSTEXPR int nback_nearest_back(const t_history &past) {
+	return nback_mask_nearest_back(nback_match_mask(past));
+}
+
+template<typename t_history>
+NBACK_CONSTEXPR bool nback_has_back(const t_history &past) {
+	return nback_match_mask(past) != 0;
+}
+
+// Occurrence masks
+//
+// The history for deep n. Next to its ring every symbol keeps a 64 bit mask
+// of where it occurred behind the head, bit n-1 for n back. A push shifts
+// the masks by one and marks the previous head, so the head's own mask
+// answers every predicate: "is there an n-back" is a non-zero test, the
+// nearest n a count of trailing zeros, and --guess_clear a reset. None of
+// them scan the history however deep it is.
+
+// t_ring holds the values (and their text, for a text_ring_t) for display
+// and logs. max_n can be set lower than the ring at run time, and only the
+// masks of the values a session at max_n draws are shifted.
+template<typename t_ring>
+class occurrence_history_t : public t_ring {
+private:
+	typedef t_ring base;
+
+public:
+	NBACK_CONSTEXPR occurrence_history_t()
+		: m_max_n(base::my_size - 1), m_mask_count(get_symbol_count(base::my_size - 1) + 1), m_masks() {
+		static_assert(base::my_size - 1 <= max_deep_n, "a mask holds 64 positions");
+	}
+
+	NBACK_CONSTEXPR void set_max_n(int max_n) {
+		assert(max_n >= 1 && max_n < base::my_size);
+		m_max_n= max_n;
+		m_mask_count= get_symbol_count(max_n) + 1;
+	}
+
+	NBACK_CONSTEXPR bool is_full() const {
+		return base::get_count() == m_max_n + 1;
+	}
 
-	if (guess_back < past.get_count()) {
-		int counter= 0;
-		int head_value= -1;
+	// bit n-1 set for every n at which the head value appeared before
+	NBACK_CONSTEXPR uint64_t get_head_matches() const {
+		return base::is_empty() ? 0 : m_masks[base::get_back(0)];
+	}
 
-	// $TODO: no loop needed, use index offset
-		for (n_back_buffer::c_const_reverse_iterator it= past.iterate_reverse();
-			guess_back >= counter && it.is_valid();
-			counter++, it.next()) {
+	NBACK_CONSTEXPR void enqueue(const int &value) {
+		assert(value >= 0 && value < m_mask_count);
 
-			if (counter==0) {
-				head_value= it.get();
-			} else if (counter == guess_back) {
-				result= (it.get() == head_value);
+		if (!base::is_empty()) {
+			NBACK_UNROLL
+			for (int symbol= 0; symbol < m_mask_count; ++symbol) {
+				m_masks[symbol]<<= 1;
 			}
+			m_masks[base::get_back(0)]|= 1;
 		}
+		base::enqueue(value);
 	}
 
-	return result;
+	// the oldest value is bit count-2 of its symbol's mask
+	NBACK_CONSTEXPR const int &dequeue() {
+		if (base::get_count() >= 2) {
+			m_masks[base::get_back(base::get_count() - 1)]&= ~((uint64_t)1 << (base::get_count() - 2));
+		}
+		return base::dequeue();
+	}
+
+	NBACK_CONSTEXPR void clear() {
+		base::clear();
+		for (int symbol= 0; symbol < max_symbol_count + 1; ++symbol) {
+			m_masks[symbol]= 0;
+		}
+	}
+
+private:
+	int m_max_n;
+	// values 0..get_symbol_count(m_max_n)
+	int m_mask_count;
+	uint64_t m_masks[max_symbol_count + 1];
+};
+
+// the masks already hold the answer
+template<typename t_ring>
+NBACK_CONSTEXPR uint64_t nback_match_mask(const occurrence_history_t<t_ring> &past) {
+	return past.get_head_matches();
 }
 
-bool nback_has_back(const n_back_buffer &past) {
-	bool result= false;
+// the history depth of a session, for the histories that can be limited
+template<typename t_history>
+NBACK_CONSTEXPR void set_history_max_n(t_history &, int) {}
+
+template<typename t_ring>
+NBACK_CONSTEXPR void set_history_max_n(occurrence_history_t<t_ring> &past, int max_n) {
+	past.set_max_n(max_n);
+}
+
+struct nback_results {
+	int correct;
+	int incorrect;
+	int incorrect_no_nback;
+	int misses;
+};
+
+// shows the next value to the history. returns its match mask, the one
+// evaluation of the history a trial needs.
+template<typename t_history>
+NBACK_CONSTEXPR uint64_t nback_push_value_matches(t_history &past, int value) {
+	if (past.is_full()) {
+		past.dequeue();
+	}
+
+	past.enqueue(value);
+
+	return nback_match_mask(past);
+}
+
+// shows the next value to the history. returns whether it has an n-back.
+template<typename t_history>
+NBACK_CONSTEXPR bool nback_push_value(t_history &past, int value) {
+	return nback_push_value_matches(past, value) != 0;
+}
 
-	int counter= 0;
-	int head_value= -1;
+// matches: the trial's nback_push_value_matches. returns true if the guess
+// was correct
+bool nback_score_trial(
+	nback_results &res,
+	uint64_t matches,
+	const optional<int> &guess_back) {
 
-	for (n_back_buffer::c_const_reverse_iterator it= past.iterate_reverse();
-		!result && it.is_valid();
-		counter++, it.next()) {
+	const bool has_nback= matches != 0;
+	bool result= false;
 
-		if (counter==0) {
-			head_value= it.get();
-		} else if (it.get()==head_value) {
+	if (guess_back.is_set) {
+		if (nback_mask_is_guess_correct(matches, guess_back.value)) {
+			res.correct++;
 			result= true;
+		} else if (has_nback) {
+			res.incorrect++;
+		} else {
+			res.incorrect_no_nback++;
 		}
+	} else {
+		// todo: should misses count all nbacks, regardless of whether past is cleared?
+		res.misses+= has_nback ? 1 : 0;
 	}
 
 	return result;
 }
 
+#ifdef NBACK_UNIT_TESTS
+// the masks against a plain ring of the same depth, with clears and a lower
+// run time max n, for builds without the compile-time checks
+void run_unit_tests_occurrence_history() {
+	typedef ring_t<int, max_deep_n + 1> deep_ring;
+	const int depths[]= { 6, 30, max_deep_n };
+	nback_rng rng(7);
+
+	for (int d= 0; d < (int)ARRAY_SIZE(depths); ++d) {
+		occurrence_history_t<deep_ring> masks;
+		deep_ring plain;
+		const int max_n= depths[d];
+
+		masks.set_max_n(max_n);
+		for (int trial= 0; trial < 2000; ++trial) {
+			const int value= (int)rng.next_below(10) + 1;
+			if (plain.get_count() == max_n + 1) {
+				plain.dequeue();
+			}
+			plain.enqueue(value);
+			const bool has_nback= nback_push_value(masks, value);
+
+			assert(masks.get_count() == plain.get_count());
+			assert(has_nback == nback_has_back(plain));
+			assert(nback_nearest_back(masks) == nback_nearest_back(plain));
+			for (int n= 0; n <= max_deep_n + 1; ++n) {
+				assert(nback_is_guess_correct(masks, n) == nback_is_guess_correct(plain, n));
+			}
+			if (rng.next_below(50) == 0) {
+				masks.clear();
+				plain.clear();
+			}
+		}
+	}
+}
+#endif // NBACK_UNIT_TESTS
+
 // User interface
 
 const int msec_per_sec= 1000;
 const int usec_per_msec= 1000;
 const int usec_per_sec= usec_per_msec * msec_per_sec;
+const int nsec_per_usec= 1000;
+
+// Timing
+
+long long monotonic_usec() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*usec_per_sec + ts.tv_nsec/nsec_per_usec;
+}
+
+struct timing_stats {
+	int samples;
+	long long min_usec;
+	long long max_usec;
+	long long total_usec;
+	double total_sq_usec;
+
+	void clear() {
+		samples= 0;
+		min_usec= 0;
+		max_usec= 0;
+		total_usec= 0;
+		total_sq_usec= 0.0;
+	}
+
+	void add(long long usec) {
+		if (samples==0 || usec < min_usec) {
+			min_usec= usec;
+		}
+		if (samples==0 || usec > max_usec) {
+			max_usec= usec;
+		}
+		++samples;
+		total_usec+= usec;
+		total_sq_usec+= (double)usec*usec;
+	}
+
+	double get_mean() const {
+		return samples ? (double)total_usec/samples : 0.0;
+	}
+
+	double get_stddev() const {
+		if (samples < 2) {
+			return 0.0;
+		}
+		const double mean= get_mean();
+		const double variance= total_sq_usec/samples - mean*mean;
+		return variance > 0.0 ? sqrt(variance) : 0.0;
+	}
+
+	void print(const char *label) const {
+		printf("%s (usec): n=%d min=%lld mean=%.1f max=%lld jitter(sd)=%.1f\n",
+			label, samples, min_usec, get_mean(), max_usec, get_stddev());
+	}
+};
+
+// onset lateness: time from the moment a stimulus was due (the end of the
+// previous trial's wait) until its line was actually on the terminal.
+// wakeup lateness: how far every timed sleep or select overshot its request.
+// reaction time: stimulus onset to the moment the guess was read.
+struct nback_timing {
+	timing_stats onset_lateness;
+	timing_stats wakeup_lateness;
+	timing_stats reaction_time;
+	long long trial_due_usec;
+	long long onset_usec;
+	long long last_onset_lateness_usec;
+	long long last_reaction_usec;
+	// cost of --busy_poll
+	long long busy_poll_cpu_usec;
+	long long busy_poll_wall_usec;
+
+	void clear() {
+		onset_lateness.clear();
+		wakeup_lateness.clear();
+		reaction_time.clear();
+		trial_due_usec= 0;
+		onset_usec= 0;
+		last_onset_lateness_usec= 0;
+		last_reaction_usec= 0;
+		busy_poll_cpu_usec= 0;
+		busy_poll_wall_usec= 0;
+	}
+
+	inline void begin_trial() {
+		trial_due_usec= monotonic_usec();
+	}
+
+	inline void mark_onset() {
+		onset_usec= monotonic_usec();
+		last_onset_lateness_usec= onset_usec - trial_due_usec;
+		onset_lateness.add(last_onset_lateness_usec);
+	}
+
+	inline void mark_input(long long input_usec) {
+		last_reaction_usec= input_usec - onset_usec;
+		reaction_time.add(last_reaction_usec);
+	}
+
+	inline void add_wakeup(long long requested_usec, long long elapsed_usec) {
+		wakeup_lateness.add(elapsed_usec > requested_usec ? elapsed_usec - requested_usec : 0);
+	}
+};
+
+long long thread_cpu_usec() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (long long)ts.tv_sec*usec_per_sec + ts.tv_nsec/nsec_per_usec;
+}
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// Realtime presentation
+
+// big enough for the deepest call chain of the game loop, with room to spare
+const int realtime_prefault_stack_size= 64 * 1024;
+
+// stdout gets a fixed buffer so that it is mapped (and locked) up front
+// rather than lazily allocated on the first printf of the first trial
+char stdout_buffer[BUFSIZ];
+
+__attribute__((noinline)) unsigned char prefault_stack() {
+	volatile unsigned char stack_pages[realtime_prefault_stack_size];
+	for (int i= 0; i < realtime_prefault_stack_size; i+= 256) {
+		stack_pages[i]= 0;
+	}
+	return stack_pages[0];
+}
+
+// Every step is best effort: missing privileges leave the game playable,
+// only with the jitter of a normal process.
+void enter_realtime_mode(const optional<int> &opt_cpu, bool use_fifo) {
+	setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		fprintf(stderr, "realtime: mlockall failed (%s), memory stays pageable\n", strerror(errno));
+	}
+	prefault_stack();
+
+	if (opt_cpu.is_set) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(opt_cpu.value, &cpus);
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+			fprintf(stderr, "realtime: cannot pin to cpu %d (%s), running unpinned\n",
+				opt_cpu.value, strerror(errno));
+		}
+	}
+
+	if (use_fifo) {
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority= sched_get_priority_min(SCHED_FIFO);
+		if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+			fprintf(stderr, "realtime: SCHED_FIFO unavailable (%s), using default scheduler\n",
+				strerror(errno));
+		}
+	}
+}
 
 class i_nback_value_provider {
 public:
@@ -250,7 +919,7 @@ public:
 class generic_value_provider : public i_nback_value_provider {
 private:
 	enum {
-		max_impl_size= 256
+		max_impl_size= 512
 	};
 public:
 
@@ -293,74 +962,109 @@ public:
 		}
 	}
 
+	template <typename t_derived, typename t_arg>
+	i_nback_value_provider *create(t_arg &arg) {
+		static_assert(
+			sizeof(t_derived) <= sizeof(storage),
+			"derived type cannot be larger than max!");
+
+		if (sizeof(t_derived) <= sizeof(storage)) {
+			return new(storage.get_allocated_storage()) t_derived(arg);
+		} else {
+			return 0;
+		}
+	}
+
+	template <typename t_derived, typename t_arg, typename t_arg2>
+	i_nback_value_provider *create(t_arg &arg, const t_arg2 &arg2) {
+		static_assert(
+			sizeof(t_derived) <= sizeof(storage),
+			"derived type cannot be larger than max!");
+
+		if (sizeof(t_derived) <= sizeof(storage)) {
+			return new(storage.get_allocated_storage()) t_derived(arg, arg2);
+		} else {
+			return 0;
+		}
+	}
+
 private:
 	generic_value_provider storage;
 };
 
+// a deck of every value 1..symbol_count in each suite
 class card_value_provider : public i_nback_value_provider {
 private:
 	enum {
-		max_value= 10,
 		suite_count= 4,
-		card_count= max_value*suite_count
+		max_card_count= max_symbol_count*suite_count
 	};
 public:
-	card_value_provider() : m_index(0) {
+	card_value_provider(nback_rng &rng, int symbol_count) : m_card_count(symbol_count*suite_count), m_index(0) {
+		static_assert(max_symbol_count <= 255, "a card is one byte");
+		assert(symbol_count >= 1 && symbol_count <= max_symbol_count);
+
 		// Assign card values
 		for (int suite_inc= 0; suite_inc < suite_count; ++suite_inc) {
-			for (int value_inc= 0; value_inc < max_value; ++value_inc) {
-				m_cards[suite_inc*max_value + value_inc]= value_inc + 1;
+			for (int value_inc= 0; value_inc < symbol_count; ++value_inc) {
+				m_cards[suite_inc*symbol_count + value_inc]= (unsigned char)(value_inc + 1);
 			}
 		}
 		
 		// go ahead and shuffle
-		shuffle_ints(&m_cards[0], card_count);
-		shuffle_ints(&m_cards[0], card_count);
-		shuffle_ints(&m_cards[0], card_count);
+		shuffle_values(&m_cards[0], m_card_count, rng);
+		shuffle_values(&m_cards[0], m_card_count, rng);
+		shuffle_values(&m_cards[0], m_card_count, rng);
 	}
 
 	virtual bool has_next() const {
-		return m_index < card_count;
+		return m_index < m_card_count;
 	}
 
 	virtual int get_next_value() {
-		assert(m_index < card_count && m_index >= 0);
+		assert(m_index < m_card_count && m_index >= 0);
 		return m_cards[m_index++];
 	}
 
 private:
-//TODO: store one value per byte, compress storage
-	int m_cards[card_count];
+	unsigned char m_cards[max_card_count];
+	int m_card_count;
 	int m_index;
 };
 
 class random_value_provider : public i_nback_value_provider {
 public:
+	random_value_provider(nback_rng &rng, int symbol_count) : m_rng(&rng), m_symbol_count(symbol_count) {}
+
 	virtual bool has_next() const {
 		return true;
 	}
 
 	virtual int get_next_value() {
-		return rand() % 10 + 1;
+		return m_rng->next_below(m_symbol_count) + 1;
 	}
+
+private:
+	nback_rng *m_rng;
+	uint32_t m_symbol_count;
 };
 
+// the --test deck, checked at compile time (see Compile-time checks)
+constexpr int test_deck[]= { 5, 6, 7, 8, 9, 4, 5, 3 };
+
 class test_value_provider : public i_nback_value_provider {
 public:
 	virtual bool has_next() const;
 
 	virtual int get_next_value() {
-		return testbuff[test_index++];
+		return test_deck[test_index++];
 	}
 private:
 	int test_index= 0;
-	static int testbuff[];
 };
 
-int test_value_provider::testbuff[]= { 5, 6, 7, 8, 9, 4, 5, 3 };
-
 bool test_value_provider::has_next() const {
-	return test_index < ARRAY_SIZE(testbuff);
+	return test_index < ARRAY_SIZE(test_deck);
 }
 
 //#define TEST_VALUE_PROVIDER_FACTORY_ASSERT
@@ -373,193 +1077,5335 @@ private:
 	int mega_buff[4096];
 };
 
-void print_n_back_buffer(const n_back_buffer &buffer) {
-	for (n_back_buffer::c_const_iterator it= buffer.iterate(); it.is_valid();) {
-		printf("%d", it.get());
-		it.next();
-		if (it.is_valid()) {
-			printf(", ");
-		}
+// Compile-time checks
+//
+// ring_t and the predicates replayed over known sequences while compiling,
+// so a regression fails the build. The reference for every trial is a plain
+// search of the deck array, which shares no code with ring_t.
+
+#ifdef NBACK_HAS_CONSTEXPR_RING
+typedef ring_t<int, 5> check_ring_t;
+
+// the reverse walk of a ring as decimal digits, newest first
+constexpr int get_reverse_digits(const check_ring_t &ring) {
+	int digits= 0;
+	for (check_ring_t::c_const_reverse_iterator it= ring.iterate_reverse(); it.is_valid(); it.next()) {
+		digits= digits*10 + it.get();
 	}
-	puts("");
+	return digits;
 }
 
-void print_current_value_line(int current_value, bool ping) {
-	static char pings[2]= { ' ', '*' };
-	fprintf(stdout, "\r%c%2d: ", pings[ping], current_value);
-	fflush(stdout);
+// filled, then head wrapped past the end by 'shifts' dequeue/enqueue pairs
+constexpr check_ring_t make_wrapped_ring(int shifts) {
+	check_ring_t ring;
+	for (int i= 1; i <= check_ring_t::my_size; ++i) {
+		ring.enqueue(i);
+	}
+	for (int i= 0; i < shifts; ++i) {
+		ring.dequeue();
+		ring.enqueue(check_ring_t::my_size + 1 + i);
+	}
+	return ring;
 }
 
-//todo: dont allow 'enter' to show history
-bool try_get_guess_with_timeout(
-	int current_value, 
-	const optional<int> &opt_guess_timeout_sec,
-	int &out_user_guess) {
+// emptied by dequeues, then reused from wherever the indices were left
+constexpr check_ring_t make_drained_ring() {
+	check_ring_t ring= make_wrapped_ring(3);
+	while (!ring.is_empty()) {
+		ring.dequeue();
+	}
+	ring.enqueue(4);
+	ring.enqueue(2);
+	return ring;
+}
+
+static_assert(check_ring_t().is_empty() && check_ring_t().get_count() == 0, "ring_t starts empty");
+static_assert(get_reverse_digits(make_wrapped_ring(0)) == 54321, "ring_t fills in order");
+static_assert(make_wrapped_ring(2).is_full() && make_wrapped_ring(2).get_count() == 5, "ring_t stays full when wrapped");
+static_assert(get_reverse_digits(make_wrapped_ring(2)) == 76543, "ring_t walks back across the wrap");
+static_assert(make_wrapped_ring(4).iterate().get() == 5, "ring_t tail follows the wrap");
+static_assert(get_reverse_digits(make_drained_ring()) == 24 && make_drained_ring().get_count() == 2, "ring_t reuse after draining");
+
+// the nearest n at which deck[trial] appeared before, within history_size
+template <int count>
+constexpr int find_reference_back(const int (&deck)[count], int trial, int history_size= n_back_buffer::my_size) {
+	for (int n= 1; n < history_size && n <= trial; ++n) {
+		if (deck[trial - n] == deck[trial]) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+// pushes every value like the game does and compares each trial's
+// predicates and match mask with the reference
+template <typename t_history, int count>
+constexpr bool replays_like_reference(const int (&deck)[count], int max_n= t_history::my_size - 1) {
+	t_history past;
+	set_history_max_n(past, max_n);
+	for (int trial= 0; trial < count; ++trial) {
+		const bool has_nback= nback_push_value(past, deck[trial]);
+		const int expected= find_reference_back(deck, trial, max_n + 1);
+
+		if (has_nback != (expected != 0) || nback_nearest_back(past) != expected) {
+			return false;
+		}
+		uint64_t expected_matches= 0;
+		for (int n= 1; n <= max_n; ++n) {
+			const bool correct= n <= trial && deck[trial - n] == deck[trial];
+			if (nback_is_guess_correct(past, n) != correct) {
+				return false;
+			}
+			expected_matches|= (uint64_t)correct << (n - 1);
+		}
+		if (nback_match_mask(past) != expected_matches) {
+			return false;
+		}
+	}
+	return true;
+}
+
+template <int count>
+constexpr int count_reference_backs(const int (&deck)[count]) {
+	int backs= 0;
+	for (int trial= 0; trial < count; ++trial) {
+		backs+= find_reference_back(deck, trial) != 0 ? 1 : 0;
+	}
+	return backs;
+}
+
+// a reproducible deck of values 1..10 drawn at compile time
+template <int count>
+struct canned_deck_t {
+	int values[count];
+
+	constexpr explicit canned_deck_t(uint64_t seed) : values() {
+		nback_rng rng(seed);
+		for (int i= 0; i < count; ++i) {
+			values[i]= (int)rng.next_below(10) + 1;
+		}
+	}
+};
+
+constexpr canned_deck_t<256> canned_deck_a(1);
+constexpr canned_deck_t<256> canned_deck_b(0x6e6261636bull);
+
+// --test: only the second 5 has an n-back, 6 back
+static_assert(count_reference_backs(test_deck) == 1 && find_reference_back(test_deck, 6) == 6, "test deck profile");
+static_assert(replays_like_reference<n_back_buffer>(test_deck), "test deck replay");
+static_assert(replays_like_reference<n_back_buffer>(canned_deck_a.values), "canned deck a replay");
+static_assert(replays_like_reference<n_back_buffer>(canned_deck_b.values), "canned deck b replay");
+// the shallowest and deepest --max_n, and the occurrence masks
+static_assert(replays_like_reference<ring_t<int, 2> >(canned_deck_a.values), "canned deck a replay, n 1");
+static_assert(replays_like_reference<ring_t<int, max_session_n + 1> >(canned_deck_b.values), "canned deck b replay, n 16");
+static_assert(replays_like_reference<occurrence_history_t<n_back_buffer> >(canned_deck_a.values), "occurrence masks replay, n 6");
+static_assert(replays_like_reference<occurrence_history_t<ring_t<int, max_deep_n + 1> > >(canned_deck_b.values), "occurrence masks replay, n 64");
+static_assert(replays_like_reference<occurrence_history_t<ring_t<int, max_deep_n + 1> > >(canned_deck_a.values, 30), "occurrence masks replay, n 30 of 64");
+#endif // NBACK_HAS_CONSTEXPR_RING
+
+// Rendering
+
+// "%2d" of every stimulus value, index 0 unused. the unpadded form of a
+// single digit value is the same text without its leading space.
+const char padded_value_text[11][3]= {
+	"  ", " 1", " 2", " 3", " 4", " 5", " 6", " 7", " 8", " 9", "10"
+};
+
+const int max_int_text_len= 11;
+
+// "%d" without printf, stimulus values straight from the table. returns the
+// length written, at most max_int_text_len.
+int format_int(char *out, int value) {
+	if (value >= 1 && value <= 10) {
+		const char *text= padded_value_text[value];
+		const int skip= text[0] == ' ' ? 1 : 0;
+		out[0]= text[skip];
+		out[1]= text[1];
+		return 2 - skip;
+	}
+
+	char digits[max_int_text_len];
+	int digit_count= 0;
+	int len= 0;
+	unsigned int magnitude= value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+	do {
+		digits[digit_count++]= (char)('0' + magnitude%10);
+		magnitude/= 10;
+	} while (magnitude != 0);
+
+	if (value < 0) {
+		out[len++]= '-';
+	}
+	while (digit_count > 0) {
+		out[len++]= digits[--digit_count];
+	}
+	return len;
+}
+
+// One screen update is formatted into a fixed buffer and handed to the
+// terminal with a single write(2), instead of a stdio call per token.
+template<int buffer_capacity>
+class frame_buffer_t {
+public:
+	enum {
+		capacity= buffer_capacity
+	};
+
+	frame_buffer_t() : m_len(0), m_truncated(false) {}
+
+	inline void clear() {
+		m_len= 0;
+		m_truncated= false;
+	}
+	inline int get_length() const { return m_len; }
+	inline const char *get_data() const { return m_data; }
+	// something was cut off at capacity since the last clear
+	inline bool is_truncated() const { return m_truncated; }
+
+	inline void append(const char *text, int len) {
+		if (len > capacity - m_len) {
+			len= capacity - m_len;
+			m_truncated= true;
+		}
+		memcpy(m_data + m_len, text, len);
+		m_len+= len;
+	}
+
+	template<int literal_size>
+	inline void append(const char (&text)[literal_size]) {
+		append(text, literal_size - 1);
+	}
+
+	inline void append_char(char c) {
+		if (m_len < capacity) {
+			m_data[m_len++]= c;
+		} else {
+			m_truncated= true;
+		}
+	}
+
+	inline void append_int(int value) {
+		char digits[max_int_text_len];
+		append(digits, format_int(digits, value));
+	}
+
+	void append_padded_value(int value) {
+		if (value >= 1 && value <= 10) {
+			append(padded_value_text[value], 2);
+		} else {
+			if (value >= 0 && value < 10) {
+				append_char(' ');
+			}
+			append_int(value);
+		}
+	}
+
+	// writes the whole frame, waiting for a full descriptor to drain. false
+	// if the write failed or the frame did not fit the buffer.
+	bool flush(int fd) {
+		int written= 0;
+
+		while (written < m_len) {
+			const ssize_t write_result= write(fd, m_data + written, m_len - written);
+			if (write_result > 0) {
+				written+= write_result;
+			} else if (write_result == -1 && errno == EINTR) {
+				continue;
+			} else if (write_result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				pollfd pfd= { fd, POLLOUT, 0 };
+				if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+					break;
+				}
+			} else {
+				break;
+			}
+		}
+
+		if (written < m_len) {
+			fprintf(stderr, "Error in write: %s\n", strerror(errno));
+		}
+		if (m_truncated) {
+			fprintf(stderr, "frame truncated at %d bytes\n", (int)capacity);
+		}
+
+		const bool complete= written == m_len && !m_truncated;
+		clear();
+		return complete;
+	}
+
+private:
+	char m_data[capacity];
+	int m_len;
+	bool m_truncated;
+};
+
+typedef frame_buffer_t<512> frame_buffer;
+
+void render_current_value_line(frame_buffer &frame, int current_value, bool ping) {
+	frame.append(ping ? "\r*" : "\r ", 2);
+	frame.append_padded_value(current_value);
+	frame.append(": ");
+}
+
+// A history ring that also keeps its ", " separated text. Each enqueue
+// appends one token and each dequeue drops one from the front, so printing
+// the history copies an existing buffer however deep the window is.
+template<int size>
+class text_ring_t : public ring_t<int, size> {
+private:
+	typedef ring_t<int, size> base;
+	enum {
+		separator_len= 2,
+		// twice the longest possible text, so compaction is rare
+		capacity= 2*size*(max_int_text_len + separator_len)
+	};
+
+public:
+	text_ring_t() : m_begin(0), m_end(0) {}
+
+	inline const char *get_text() const { return m_text + m_begin; }
+	inline int get_text_length() const { return m_end - m_begin; }
+
+	void enqueue(const int &value) {
+		base::enqueue(value);
+
+		if (m_end + max_int_text_len + separator_len > capacity) {
+			compact();
+		}
+		if (m_end > m_begin) {
+			m_text[m_end++]= ',';
+			m_text[m_end++]= ' ';
+		}
+		const int token_len= format_int(m_text + m_end, value);
+		m_end+= token_len;
+		m_token_lengths.enqueue((unsigned char)token_len);
+	}
+
+	const int &dequeue() {
+		m_begin+= m_token_lengths.dequeue();
+		if (m_token_lengths.is_empty()) {
+			m_begin= 0;
+			m_end= 0;
+		} else {
+			m_begin+= separator_len;
+		}
+
+		return base::dequeue();
+	}
+
+	inline void clear() {
+		base::clear();
+		m_token_lengths.clear();
+		m_begin= 0;
+		m_end= 0;
+	}
+
+private:
+	void compact() {
+		memmove(m_text, m_text + m_begin, m_end - m_begin);
+		m_end-= m_begin;
+		m_begin= 0;
+	}
+
+	char m_text[capacity];
+	int m_begin;
+	int m_end;
+	ring_t<unsigned char, size> m_token_lengths;
+};
+
+typedef text_ring_t<n_back_buffer::my_size> n_back_history;
+
+#ifdef NBACK_UNIT_TESTS
+void run_unit_tests_text_ring_t() {
+
+	typedef text_ring_t<3> test_ring_t;
+	test_ring_t test;
+	char expected[64];
+
+	assert(test.get_text_length() == 0);
+
+	// run long enough to wrap and compact several times
+	for (int i= 1; i <= 100; ++i) {
+		if (test.is_full()) {
+			test.dequeue();
+		}
+		test.enqueue(i%11 == 0 ? -i : i);
+
+		int expected_len= 0;
+		for (test_ring_t::c_const_iterator it= test.iterate(); it.is_valid();) {
+			expected_len+= snprintf(expected + expected_len, sizeof(expected) - expected_len, "%d", it.get());
+			it.next();
+			if (it.is_valid()) {
+				expected_len+= snprintf(expected + expected_len, sizeof(expected) - expected_len, ", ");
+			}
+		}
+		assert(test.get_text_length() == expected_len);
+		assert(memcmp(test.get_text(), expected, expected_len) == 0);
+	}
+
+	test.clear();
+	assert(test.get_text_length() == 0);
+	test.enqueue(10);
+	assert(test.get_text_length() == 2 && memcmp(test.get_text(), "10", 2) == 0);
+}
+#endif // NBACK_UNIT_TESTS
+
+template<int t_size>
+void render_n_back_buffer(frame_buffer &frame, const text_ring_t<t_size> &buffer) {
+	frame.append(buffer.get_text(), buffer.get_text_length());
+	frame.append_char('\n');
+}
+
+void render_verdict(frame_buffer &frame, bool correct) {
+	if (correct) {
+		frame.append("correct! resuming...\n");
+	} else {
+		frame.append("wrong! resuming...\n");
+	}
+}
+
+void write_current_value_line(frame_buffer &frame, int fd, int current_value, bool ping) {
+	render_current_value_line(frame, current_value, ping);
+	frame.flush(fd);
+}
+
+template<int t_size>
+void write_guess_verdict(frame_buffer &frame, int fd, const text_ring_t<t_size> &past, bool print_history, bool correct) {
+	if (print_history) {
+		render_n_back_buffer(frame, past);
+	}
+	render_verdict(frame, correct);
+	frame.flush(fd);
+}
+
+// Full screen display
+//
+// The stimulus, history, a countdown bar and the score on the alternate
+// screen. Every refresh draws the whole layout into a cell grid, compares it
+// with what the terminal already shows and sends only the changed cells,
+// batched into one write. A countdown tick usually costs a few bytes.
+
+class tui_screen {
+private:
+	enum {
+		max_rows= 64,
+		max_cols= 256,
+		// a cursor move costs more than rewriting this many unchanged cells
+		max_gap_to_rewrite= 4
+	};
+
+	enum {
+		attr_normal= 0,
+		attr_bold= 1,
+		attr_reverse= 2
+	};
+
+	struct cell {
+		char ch;
+		unsigned char attr;
+
+		inline bool operator!=(const cell &other) const {
+			return ch != other.ch || attr != other.attr;
+		}
+	};
+
+public:
+	tui_screen()
+		: m_fd(-1), m_rows(0), m_cols(0), m_active(false), m_full_redraw(true), m_termios_saved(false),
+		m_value(0), m_ping(false), m_history_len(0),
+		m_remaining_usec(0), m_total_usec(0), m_message(""), m_max_n(0) {
+		memset(&m_res, 0, sizeof(m_res));
+	}
+
+	inline bool is_active() const { return m_active; }
+
+	// takes over the terminal behind fd. input is read a byte at a time
+	// without echo, or typed guesses would scroll the screen under m_front.
+	bool enter(int fd, int max_n) {
+		m_fd= fd;
+		m_max_n= max_n;
+		if (!isatty(m_fd)) {
+			return false;
+		}
+
+		if (tcgetattr(m_fd, &m_saved_termios) == 0) {
+			termios raw= m_saved_termios;
+			raw.c_lflag&= ~(ECHO | ICANON);
+			raw.c_cc[VMIN]= 1;
+			raw.c_cc[VTIME]= 0;
+			m_termios_saved= tcsetattr(m_fd, TCSANOW, &raw) == 0;
+		}
+
+		m_out.append("\x1b[?1049h\x1b[?25l");
+		m_active= true;
+		resize();
+		refresh();
+		return true;
+	}
+
+	// back after a leave(), e.g. when resumed from SIGTSTP
+	bool resume() {
+		return enter(m_fd, m_max_n);
+	}
+
+	void leave() {
+		if (m_active) {
+			m_out.append("\x1b[0m\x1b[?25h\x1b[?1049l");
+			m_out.flush(m_fd);
+			m_active= false;
+		}
+		if (m_termios_saved) {
+			tcsetattr(m_fd, TCSANOW, &m_saved_termios);
+			m_termios_saved= false;
+		}
+	}
+
+	// after SIGWINCH or SIGCONT: the terminal content is unknown
+	void resize() {
+		winsize size;
+		if (ioctl(m_fd, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 && size.ws_col > 0) {
+			m_rows= std::min((int)size.ws_row, (int)max_rows);
+			m_cols= std::min((int)size.ws_col, (int)max_cols);
+		} else {
+			m_rows= 24;
+			m_cols= 80;
+		}
+		m_full_redraw= true;
+	}
+
+	// state
+
+	void set_stimulus(int value, bool ping) {
+		if (value != m_value) {
+			m_message= "";
+		}
+		m_value= value;
+		m_ping= ping;
+	}
+
+	void set_countdown(long long remaining_usec, long long total_usec) {
+		m_remaining_usec= remaining_usec > 0 ? remaining_usec : 0;
+		m_total_usec= total_usec;
+	}
+
+	// a copy: the ring's text moves on every push, compaction and clear,
+	// while the screen keeps redrawing it. only what fits a row is kept.
+	template<int t_size>
+	void set_history(const text_ring_t<t_size> &past) {
+		m_history_len= std::min(past.get_text_length(), (int)max_cols);
+		memcpy(m_history, past.get_text(), m_history_len);
+	}
+
+	void set_verdict(bool correct, const nback_results &res) {
+		m_message= correct ? "correct! resuming..." : "wrong! resuming...";
+		m_res= res;
+	}
+
+	void set_results(const nback_results &res) {
+		m_res= res;
+	}
+
+	void set_message(const char *message) {
+		m_message= message;
+	}
+
+	// draws the state and sends what changed
+	void refresh() {
+		if (!m_active) {
+			return;
+		}
+		draw();
+		present();
+	}
+
+private:
+	void draw() {
+		const cell blank= { ' ', attr_normal };
+		for (int i= 0; i < m_rows*m_cols; ++i) {
+			m_back[i]= blank;
+		}
+
+		char line[max_cols];
+		int len;
+
+		put_text(0, 1, "N-back", 6, attr_bold);
+		len= snprintf(line, sizeof(line), "correct %d  wrong %d  missed %d",
+			m_res.correct, m_res.incorrect + m_res.incorrect_no_nback, m_res.misses);
+		put_text(0, m_cols - 1 - len, line, len, attr_normal);
+
+		len= snprintf(line, sizeof(line), "how far back was it? (max %d)", m_max_n);
+		put_text(1, 1, line, len, attr_normal);
+
+		// the stimulus, flashed in reverse video while the ping is up
+		if (m_value != 0) {
+			char value_text[max_int_text_len + 4]= { ' ', ' ' };
+			const int value_len= format_int(value_text + 2, m_value) + 4;
+			value_text[value_len - 2]= ' ';
+			value_text[value_len - 1]= ' ';
+			put_text(3, (m_cols - value_len)/2, value_text, value_len,
+				attr_bold | (m_ping ? attr_reverse : attr_normal));
+		}
+
+		put_text(5, 1, "history: ", 9, attr_normal);
+		put_text(5, 10, m_history, m_history_len, attr_normal);
+
+		// countdown
+		const int bar_width= m_cols - 12;
+		if (bar_width > 0 && m_total_usec > 0) {
+			const int filled= (int)(bar_width*m_remaining_usec/m_total_usec);
+			put_text(7, 1, "[", 1, attr_normal);
+			for (int i= 0; i < bar_width; ++i) {
+				put_char(7, 2 + i, i < filled ? '#' : '.', i < filled ? attr_bold : attr_normal);
+			}
+			put_text(7, 2 + bar_width, "]", 1, attr_normal);
+			len= snprintf(line, sizeof(line), "%2lld.%llds",
+				m_remaining_usec/usec_per_sec, m_remaining_usec%usec_per_sec/(usec_per_sec/10));
+			put_text(7, 4 + bar_width, line, len, attr_normal);
+		}
+
+		put_text(9, 1, m_message, strlen(m_message), attr_bold);
+		put_text(m_rows - 1, 1, "enter a number to guess, ctrl-z pauses, ctrl-c quits", 52, attr_normal);
+	}
+
+	inline void put_char(int row, int col, char c, unsigned char attr) {
+		if (row >= 0 && row < m_rows && col >= 0 && col < m_cols) {
+			cell &target= m_back[row*m_cols + col];
+			target.ch= c;
+			target.attr= attr;
+		}
+	}
+
+	void put_text(int row, int col, const char *text, int len, unsigned char attr) {
+		for (int i= 0; i < len; ++i) {
+			put_char(row, col + i, text[i], attr);
+		}
+	}
+
+	void append_attr(unsigned char attr) {
+		m_out.append("\x1b[0");
+		if (attr & attr_bold) {
+			m_out.append(";1");
+		}
+		if (attr & attr_reverse) {
+			m_out.append(";7");
+		}
+		m_out.append_char('m');
+	}
+
+	void append_cursor_move(int row, int col) {
+		m_out.append("\x1b[");
+		m_out.append_int(row + 1);
+		m_out.append_char(';');
+		m_out.append_int(col + 1);
+		m_out.append_char('H');
+	}
+
+	void present() {
+		unsigned char out_attr= attr_normal;
+
+		if (m_full_redraw) {
+			const cell blank= { ' ', attr_normal };
+			m_out.append("\x1b[0m\x1b[H\x1b[2J");
+			for (int i= 0; i < m_rows*m_cols; ++i) {
+				m_front[i]= blank;
+			}
+			m_full_redraw= false;
+		}
+
+		for (int row= 0; row < m_rows; ++row) {
+			const cell *back= m_back + row*m_cols;
+			const cell *front= m_front + row*m_cols;
+			int cursor_col= -1;
+
+			for (int col= 0; col < m_cols; ++col) {
+				if (!(back[col] != front[col])) {
+					continue;
+				}
+
+				if (cursor_col == -1 || col - cursor_col > max_gap_to_rewrite) {
+					append_cursor_move(row, col);
+				} else {
+					// cheaper to repeat the few unchanged cells in between
+					for (int gap= cursor_col; gap < col; ++gap) {
+						if (back[gap].attr != out_attr) {
+							out_attr= back[gap].attr;
+							append_attr(out_attr);
+						}
+						m_out.append_char(back[gap].ch);
+					}
+				}
+
+				if (back[col].attr != out_attr) {
+					out_attr= back[col].attr;
+					append_attr(out_attr);
+				}
+				m_out.append_char(back[col].ch);
+				cursor_col= col + 1;
+			}
+		}
+
+		if (out_attr != attr_normal) {
+			append_attr(attr_normal);
+		}
+		memcpy(m_front, m_back, sizeof(cell)*m_rows*m_cols);
+
+		if (m_out.get_length() != 0) {
+			m_out.flush(m_fd);
+		}
+	}
+
+	int m_fd;
+	int m_rows;
+	int m_cols;
+	bool m_active;
+	bool m_full_redraw;
+	bool m_termios_saved;
+	termios m_saved_termios;
+	// what is shown
+	int m_value;
+	bool m_ping;
+	char m_history[max_cols];
+	int m_history_len;
+	long long m_remaining_usec;
+	long long m_total_usec;
+	const char *m_message;
+	int m_max_n;
+	nback_results m_res;
+	// what the terminal has, what it should have
+	cell m_front[max_rows*max_cols];
+	cell m_back[max_rows*max_cols];
+	frame_buffer_t<max_rows*max_cols*16> m_out;
+};
+
+// the interactive game owns stdout through this frame. stdio output (banner,
+// summary) must be flushed before a frame is written.
+// with --tui the full screen display takes its place.
+frame_buffer stdout_frame;
+tui_screen stdout_tui;
+
+void print_current_value_line(int current_value, bool ping) {
+	if (stdout_tui.is_active()) {
+		stdout_tui.set_stimulus(current_value, ping);
+		stdout_tui.refresh();
+	} else {
+		write_current_value_line(stdout_frame, STDOUT_FILENO, current_value, ping);
+	}
+}
+
+// one tick of the guess timeout. only the full screen display shows it.
+void print_countdown(long long remaining_usec, long long total_usec) {
+	if (stdout_tui.is_active()) {
+		stdout_tui.set_countdown(remaining_usec, total_usec);
+		stdout_tui.refresh();
+	}
+}
+
+template<int t_size>
+void print_guess_verdict(const text_ring_t<t_size> &past, bool print_history, bool correct, const nback_results &res) {
+	if (stdout_tui.is_active()) {
+		if (print_history) {
+			stdout_tui.set_history(past);
+		}
+		stdout_tui.set_verdict(correct, res);
+		stdout_tui.refresh();
+	} else {
+		write_guess_verdict(stdout_frame, STDOUT_FILENO, past, print_history, correct);
+	}
+}
+
+// Input
+
+// Reads guesses straight from a file descriptor into one reusable buffer and
+// parses the leading integer of each line in place. Each line is stamped with
+// the time its first byte was read, so a caller can reject type-ahead that
+// arrived before the stimulus it is answering.
+class guess_reader {
+private:
+	enum {
+		read_buffer_size= 256,
+		max_pending_guesses= 8,
+		max_guess_digits= 9
+	};
+
+	struct timed_guess {
+		int value;
+		long long usec;
+	};
+
+	enum e_line_state {
+		line_start,
+		line_number,
+		line_rest
+	};
+
+public:
+	guess_reader(int fd) : m_fd(fd), m_eof(false), m_read_calls(0) {
+		const int flags= fcntl(fd, F_GETFL);
+		m_nonblocking= flags != -1 && (flags & O_NONBLOCK) != 0;
+		reset_line();
+	}
+
+	inline int get_fd() const { return m_fd; }
+	inline bool is_eof() const { return m_eof; }
+	// reads, plus the readiness polls of a blocking descriptor
+	inline long long get_read_calls() const { return m_read_calls; }
+
+	// reads everything pending without blocking. returns true if any bytes came in.
+	bool drain() {
+		bool got_bytes= false;
+
+		while (!m_eof) {
+			const ssize_t read_result= read_pending();
+
+			if (read_result > 0) {
+				feed(m_buff, read_result, monotonic_usec());
+				got_bytes= true;
+			} else if (read_result == 0) {
+				m_eof= true;
+			} else if (errno == EINTR) {
+				continue;
+			} else {
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					fprintf(stderr, "Error in read: %s\n", strerror(errno));
+					m_eof= true;
+				}
+				break;
+			}
+		}
+
+		return got_bytes;
+	}
+
+	// a single read for an edge triggered readiness event. a short read means
+	// the descriptor is empty, so only a full buffer needs another call.
+	// returns whether there may be more to read.
+	bool drain_once() {
+		while (!m_eof) {
+			const ssize_t read_result= read_pending();
+
+			if (read_result > 0) {
+				feed(m_buff, read_result, monotonic_usec());
+				return read_result == (ssize_t)sizeof(m_buff);
+			} else if (read_result == 0) {
+				m_eof= true;
+			} else if (errno != EINTR) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					fprintf(stderr, "Error in read: %s\n", strerror(errno));
+					m_eof= true;
+				}
+				break;
+			}
+		}
+		return false;
+	}
+
+	// drops everything typed before a stimulus is shown
+	void discard_pending() {
+		drain();
+		discard_buffered();
+	}
+
+	// the same, for callers that know nothing new arrived since the last read
+	void discard_buffered() {
+		m_guesses.clear();
+		if (m_line_state != line_start) {
+			// the rest of this line belongs to the stale input too
+			m_line_usec= -1;
+		}
+	}
+
+	bool pop_guess(long long onset_usec, int &out_guess, long long &out_usec) {
+		while (!m_guesses.is_empty()) {
+			const timed_guess guess= m_guesses.dequeue();
+			if (guess.usec >= onset_usec) {
+				out_guess= guess.value;
+				out_usec= guess.usec;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void feed(const char *bytes, int len, long long usec) {
+		for (int i= 0; i < len; ++i) {
+			const char c= bytes[i];
+
+			if (c == '\n') {
+				if (m_line_digits > 0 && m_line_usec >= 0 && !m_guesses.is_full()) {
+					const timed_guess guess= { m_line_sign*m_line_value, m_line_usec };
+					m_guesses.enqueue(guess);
+				}
+				reset_line();
+				continue;
+			}
+
+			if (m_line_state == line_start && m_line_usec == 0) {
+				m_line_usec= usec;
+			}
+
+			switch (m_line_state) {
+				case line_start:
+					if (c == '-' || c == '+') {
+						m_line_sign= (c == '-') ? -1 : 1;
+						m_line_state= line_number;
+					} else if (c >= '0' && c <= '9') {
+						m_line_state= line_number;
+						add_digit(c);
+					} else if (c != ' ' && c != '\t' && c != '\r') {
+						m_line_state= line_rest;
+					}
+					break;
+
+				case line_number:
+					if (c >= '0' && c <= '9') {
+						add_digit(c);
+					} else {
+						m_line_state= line_rest;
+					}
+					break;
+
+				case line_rest:
+					break;
+			}
+		}
+	}
+
+private:
+	// one read that cannot block, or -1 with EAGAIN when nothing is pending.
+	// polls first rather than setting O_NONBLOCK: fd 0 usually shares its
+	// open file description with stdout (a tty, or the socket a prefork
+	// worker dup2s onto both), and the flag would make stdout non-blocking too.
+	// a descriptor that is non-blocking already (an accepted server
+	// connection) is read directly
+	ssize_t read_pending() {
+		if (m_nonblocking) {
+			++m_read_calls;
+			return read(m_fd, m_buff, sizeof(m_buff));
+		}
+
+		pollfd pfd= { m_fd, POLLIN, 0 };
+		++m_read_calls;
+		const int ready= poll(&pfd, 1, 0);
+
+		if (ready == 0) {
+			errno= EAGAIN;
+			return -1;
+		} else if (ready < 0) {
+			return -1;
+		}
+
+		++m_read_calls;
+		return read(m_fd, m_buff, sizeof(m_buff));
+	}
+
+	inline void reset_line() {
+		m_line_state= line_start;
+		m_line_usec= 0;
+		m_line_sign= 1;
+		m_line_value= 0;
+		m_line_digits= 0;
+	}
+
+	inline void add_digit(char c) {
+		if (m_line_digits < max_guess_digits) {
+			m_line_value= m_line_value*10 + (c - '0');
+		}
+		++m_line_digits;
+	}
+
+	int m_fd;
+	bool m_nonblocking;
+	bool m_eof;
+	long long m_read_calls;
+	char m_buff[read_buffer_size];
+	ring_t<timed_guess, max_pending_guesses> m_guesses;
+	// line in progress. usec 0: nothing read yet, -1: stale
+	e_line_state m_line_state;
+	long long m_line_usec;
+	int m_line_sign;
+	int m_line_value;
+	int m_line_digits;
+};
+
+// Signals
+
+// SIGINT/SIGTERM/SIGWINCH/SIGTSTP stay blocked for the whole session and are
+// read from a signalfd next to the input, so every wait sees them as just
+// another readable descriptor and is never interrupted half way.
+class session_signals {
+public:
+	enum {
+		event_shutdown= 1,
+		event_redraw= 2
+	};
+
+	session_signals() : m_fd(-1), m_screen(0), m_shutdown(false) {}
+
+	~session_signals() {
+		close();
+	}
+
+	bool open() {
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		sigaddset(&mask, SIGWINCH);
+		sigaddset(&mask, SIGTSTP);
+
+		sigprocmask(SIG_BLOCK, &mask, &m_saved_mask);
+		m_fd= signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (m_fd == -1) {
+			sigprocmask(SIG_SETMASK, &m_saved_mask, NULL);
+		}
+		return m_fd != -1;
+	}
+
+	void close() {
+		if (m_fd != -1) {
+			::close(m_fd);
+			m_fd= -1;
+			sigprocmask(SIG_SETMASK, &m_saved_mask, NULL);
+		}
+	}
+
+	inline int get_fd() const { return m_fd; }
+	inline bool is_shutdown_requested() const { return m_shutdown; }
+
+	// a full screen display to resize and hand back on suspend
+	inline void set_screen(tui_screen *screen) { m_screen= screen; }
+
+	// consumes every queued signal, returns a mask of event_* flags
+	int process() {
+		int events= 0;
+		signalfd_siginfo info;
+
+		while (m_fd != -1 && read(m_fd, &info, sizeof(info)) == sizeof(info)) {
+			switch (info.ssi_signo) {
+				case SIGINT:
+				case SIGTERM:
+					m_shutdown= true;
+					events|= event_shutdown;
+					break;
+
+				case SIGWINCH:
+					if (m_screen && m_screen->is_active()) {
+						m_screen->resize();
+					}
+					events|= event_redraw;
+					break;
+
+				case SIGTSTP:
+					suspend();
+					events|= event_redraw;
+					break;
+			}
+		}
+
+		return events;
+	}
+
+	// sleeps without swallowing signals. returns false if the session should end.
+	bool wait_usec(long long usec, nback_timing &timing) {
+		const long long start_usec= monotonic_usec();
+		const long long deadline_usec= start_usec + usec;
+		bool interrupted= false;
+
+		for (long long now_usec= start_usec; !m_shutdown && now_usec < deadline_usec;) {
+			pollfd pfd= { m_fd, POLLIN, 0 };
+			const int timeout_msec= (int)((deadline_usec - now_usec + usec_per_msec - 1)/usec_per_msec);
+
+			if (poll(&pfd, m_fd != -1 ? 1 : 0, timeout_msec) > 0) {
+				process();
+				interrupted= true;
+			}
+			now_usec= monotonic_usec();
+		}
+
+		if (!interrupted) {
+			timing.add_wakeup(usec, monotonic_usec() - start_usec);
+		}
+		return !m_shutdown;
+	}
+
+private:
+	// hand the terminal back, stop, and take it again on SIGCONT
+	void suspend() {
+		const bool had_screen= m_screen && m_screen->is_active();
+		if (had_screen) {
+			m_screen->leave();
+		}
+		fputs("\n[paused]\n", stdout);
+		fflush(stdout);
+
+		raise(SIGSTOP);
+
+		if (had_screen) {
+			m_screen->resume();
+		}
+	}
+
+	int m_fd;
+	tui_screen *m_screen;
+	bool m_shutdown;
+	sigset_t m_saved_mask;
+};
+
+const int time_to_show_ping_usec= 150 * usec_per_msec;
+const int default_guess_timeout_sec= 2;
+
+inline int get_guess_timeout_sec(const optional<int> &opt_guess_timeout_sec) {
+	return opt_guess_timeout_sec.is_set
+		? opt_guess_timeout_sec.value
+		: default_guess_timeout_sec;
+}
+
+// Spins on the non-blocking input instead of sleeping in select, so a guess
+// is timestamped within microseconds of arriving. Backs off from pause
+// instructions to sched_yield; note that under SCHED_FIFO the yield only
+// gives way to equal priority tasks.
+bool try_get_guess_busy_poll(
+	int current_value,
+	const optional<int> &opt_guess_timeout_sec,
+	guess_reader &input,
+	session_signals &signals,
+	nback_timing &timing,
+	int &out_user_guess) {
+
+	bool result= false;
+	long long guess_usec;
+
+	const int max_pause_spins= 64;
+
+	const long long cpu_start_usec= thread_cpu_usec();
+	input.discard_pending();
+	print_current_value_line(current_value, true);
+	timing.mark_onset();
+
+	const long long ping_deadline_usec= timing.onset_usec + time_to_show_ping_usec;
+	const long long deadline_usec= timing.onset_usec
+		+ (long long)get_guess_timeout_sec(opt_guess_timeout_sec)*usec_per_sec;
+	const int countdown_tick_usec= 50 * usec_per_msec;
+	bool ping_shown= true;
+	int pause_spins= 1;
+	long long now_usec= timing.onset_usec;
+	long long next_countdown_usec= now_usec;
+
+	while (!result && !signals.is_shutdown_requested() && now_usec < deadline_usec) {
+		const int signal_events= signals.process();
+		if (signal_events & session_signals::event_redraw) {
+			print_current_value_line(current_value, ping_shown);
+		}
+
+		if (input.drain()) {
+			pause_spins= 1;
+			result= input.pop_guess(timing.onset_usec, out_user_guess, guess_usec);
+			if (result) {
+				timing.mark_input(guess_usec);
+			}
+		} else if (pause_spins <= max_pause_spins) {
+			for (int i= 0; i < pause_spins; ++i) {
+				cpu_relax();
+			}
+			pause_spins*= 2;
+		} else {
+			sched_yield();
+		}
+
+		now_usec= monotonic_usec();
+		if (ping_shown && now_usec >= ping_deadline_usec) {
+			print_current_value_line(current_value, false);
+			ping_shown= false;
+		}
+		if (now_usec >= next_countdown_usec) {
+			print_countdown(deadline_usec - now_usec, deadline_usec - timing.onset_usec);
+			next_countdown_usec= now_usec + countdown_tick_usec;
+		}
+	}
+
+	timing.busy_poll_cpu_usec+= thread_cpu_usec() - cpu_start_usec;
+	timing.busy_poll_wall_usec+= now_usec - timing.onset_usec;
+
+	return result;
+}
+
+//todo: dont allow 'enter' to show history
+bool try_get_guess_with_timeout(
+	int current_value, 
+	const optional<int> &opt_guess_timeout_sec,
+	bool busy_poll,
+	guess_reader &input,
+	session_signals &signals,
+	nback_timing &timing,
+	int &out_user_guess) {
+
+	if (busy_poll) {
+		return try_get_guess_busy_poll(
+			current_value, opt_guess_timeout_sec, input, signals, timing, out_user_guess);
+	}
+
+	bool result= false;
+	fd_set read_fds;
+	int select_result;
+	long long guess_usec;
+	const int max_fd= input.get_fd() > signals.get_fd() ? input.get_fd() : signals.get_fd();
+
+	const int per_select_timeout_usec= 50 * usec_per_msec;
+	const int iterations_to_show_ping= time_to_show_ping_usec/per_select_timeout_usec;
+
+	const int total_timeout_seconds= get_guess_timeout_sec(opt_guess_timeout_sec);
+	const int iterations_before_give_up=
+		total_timeout_seconds*usec_per_sec/per_select_timeout_usec;
+
+	input.discard_pending();
+
+	for (int cnt= 0; !result && !signals.is_shutdown_requested() && cnt < iterations_before_give_up; ++cnt) {
+
+		timeval tv;
+		tv.tv_sec= 0;
+		tv.tv_usec= per_select_timeout_usec;
+
+		FD_ZERO(&read_fds);
+		if (!input.is_eof()) {
+			FD_SET(input.get_fd(), &read_fds);
+		}
+		if (signals.get_fd() != -1) {
+			FD_SET(signals.get_fd(), &read_fds);
+		}
+
+		if (cnt==0 || cnt==iterations_to_show_ping) {
+			print_current_value_line(current_value, cnt < iterations_to_show_ping);
+			if (cnt==0) {
+				timing.mark_onset();
+			}
+		}
+		print_countdown(
+			(long long)(iterations_before_give_up - cnt)*per_select_timeout_usec,
+			(long long)iterations_before_give_up*per_select_timeout_usec);
+
+		const long long select_start_usec= monotonic_usec();
+		select_result= select(max_fd + 1, &read_fds, NULL, NULL, &tv);
+
+		if (select_result == -1) {
+			// signals we care about arrive through signalfd, anything else
+			// (e.g. a stop/continue) just costs this slice of the wait
+			if (errno != EINTR) {
+				fprintf(stderr, "Error in select: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		} else if (select_result == 0) {
+			//no result
+			timing.add_wakeup(per_select_timeout_usec, monotonic_usec() - select_start_usec);
+		} else {
+			if (signals.get_fd() != -1 && FD_ISSET(signals.get_fd(), &read_fds)) {
+				if (signals.process() & session_signals::event_redraw) {
+					print_current_value_line(current_value, cnt < iterations_to_show_ping);
+				}
+			}
+
+			if (FD_ISSET(input.get_fd(), &read_fds)) {
+				input.drain();
+			}
+			result= input.pop_guess(timing.onset_usec, out_user_guess, guess_usec);
+			if (result) {
+				timing.mark_input(guess_usec);
+			}
+		}
+	}
+
+	return result;
+}
+
+// simulated player, see Simulation
+const int max_sim_n= n_back_buffer::my_size - 1;
+
+struct synthetic_player {
+	// chance of spotting an n-back at distance n, index n
+	double hit_rate[max_sim_n + 1];
+	// chance of guessing a random n when there is nothing to find
+	double false_alarm_rate;
+	int rt_mean_msec;
+	int rt_sd_msec;
+
+	void clear() {
+		for (int n= 0; n <= max_sim_n; ++n) {
+			hit_rate[n]= n == 0 ? 0.0 : 1.0 - 0.1*n;
+		}
+		false_alarm_rate= 0.05;
+		rt_mean_msec= 700;
+		rt_sd_msec= 200;
+	}
+};
+
+// "0.9" for every n, or "0.9,0.8,0.7" per n with the last repeated
+bool parse_hit_rates(const char *text, synthetic_player &out_player) {
+	double rate= 0.0;
+	for (int n= 1; n <= max_sim_n; ++n) {
+		if (*text) {
+			char *end;
+			rate= strtod(text, &end);
+			if (end == text || rate < 0.0 || rate > 1.0) {
+				return false;
+			}
+			text= (*end == ',') ? end + 1 : end;
+		}
+		out_player.hit_rate[n]= rate;
+	}
+	return *text == '\0';
+}
+
+struct nback_options {
+	// modes
+	int test_mode;
+	int random_mode;
+	// settings
+	optional<int> timeout_sec;
+	int max_n;
+	int print_buffer_on_guess;
+	int clear_buffer_on_guess;
+	int print_timing;
+	int fast_start;
+	int busy_poll;
+	int coro_mode;
+	int tui_mode;
+	int headless_mode;
+	const char *headless_script;
+	optional<int> headless_fd;
+	optional<int> bench_render_trials;
+	optional<int> bench_startup_runs;
+	const char *log_path;
+	int log_binary;
+	// server
+	const char *serve_path;
+	int server_shards;
+	int prefork_workers;
+	// load generator
+	int load_trainees;
+	const char *load_socket_path;
+	int load_steps;
+	// simulation
+	optional<long long> simulate_sessions;
+	uint64_t seed;
+	int sim_trials;
+	int sim_threads;
+	int sim_bank;
+	const char *sim_kernel;
+	int sim_huge_pages;
+	synthetic_player player;
+	// realtime
+	int realtime_mode;
+	int realtime_fifo;
+	optional<int> realtime_cpu;
+
+	void clear() {
+		test_mode= 0;
+		random_mode= 0;
+		timeout_sec= {false, 0};
+		max_n= n_back_buffer::my_size - 1;
+		print_buffer_on_guess= 1;
+		clear_buffer_on_guess= 0;
+		print_timing= 0;
+		fast_start= 0;
+		busy_poll= 0;
+		coro_mode= 0;
+		tui_mode= 0;
+		headless_mode= 0;
+		headless_script= 0;
+		headless_fd= {false, 0};
+		bench_render_trials= {false, 0};
+		bench_startup_runs= {false, 0};
+		log_path= 0;
+		log_binary= 0;
+		serve_path= 0;
+		server_shards= 0;
+		prefork_workers= 0;
+		load_trainees= 0;
+		load_socket_path= 0;
+		load_steps= 1;
+		simulate_sessions= {false, 0};
+		seed= 1;
+		sim_trials= 40;
+		sim_threads= 0;
+		sim_bank= 0;
+		sim_kernel= 0;
+		sim_huge_pages= 0;
+		player.clear();
+		realtime_mode= 0;
+		realtime_fifo= 0;
+		realtime_cpu= {false, 0};
+	}
+};
+
+void display_usage() {
+	puts("N-Back brain improvement. by: jelly   ");
+	puts("Options:                                                   ");
+	puts("  --cards          : default, shuffled deck, 4 per value   ");
+	puts("                     40 cards up to --max_n 6, ~7n deeper  ");
+	puts("  --test           : test mode, short and predictable      ");
+	puts("  --random         : 'true random' mode. never ends     ");
+	puts("  --no_history     : disables history display on each guess");
+	puts("  --guess_reset    : resets history on each guess        ");
+	puts("  --seconds [v]    : set timeout for each guess (from 2)   ");
+	puts("  --max_n [v]      : deepest n, 1 to 64 (default 6)        ");
+	puts("  --timing         : print stimulus onset/wakeup jitter    ");
+	puts("  --fast_start     : no pauses after the banner            ");
+	puts("  --busy_poll      : spin on input for usec timestamps     ");
+	puts("  --coro           : run the session on the coroutine loop ");
+	puts("  --tui            : full screen display with countdown    ");
+	puts("  --headless       : no display or pauses, json summary    ");
+	puts("  --script [f]     : headless guesses, one line per number ");
+	puts("  --input_fd [v]   : headless guesses from descriptor v    ");
+	puts("  --log [f]        : write a json line per trial to f      ");
+	puts("  --log_binary     : with --log, fixed size binary records ");
+	puts("  --serve [path]   : host sessions on a unix socket        ");
+	puts("  --shards [v]     : with --serve, one event loop per core ");
+	puts("  --prefork [v]    : with --serve, v warm session processes");
+	puts("  --load [v]       : v synthetic trainees on ptys, report  ");
+	puts("  --load_socket [p]: with --load, play against a server    ");
+	puts("  --load_ramp [v]  : with --load, ramp up in v steps       ");
+	puts("  --simulate [v]   : play v sessions with a synthetic player");
+	puts("  --seed [v]       : simulation seed                       ");
+	puts("  --sim_hit [r,..] : hit rate, one value or one per n      ");
+	puts("  --sim_fa [r]     : false alarm rate                      ");
+	puts("  --sim_rt [ms]    : mean reaction time                    ");
+	puts("  --sim_rt_sd [ms] : reaction time deviation               ");
+	puts("  --sim_trials [v] : max trials per simulated session      ");
+	puts("  --threads [v]    : simulation threads, default every core");
+	puts("  --sim_bank       : step sessions in lockstep batches     ");
+	puts("  --sim_kernel [k] : bank kernel: avx512, avx2, scalar, auto");
+	puts("  --sim_huge_pages : back simulation memory with huge pages");
+	puts("  --realtime       : lock memory, low-jitter presentation  ");
+	puts("  --cpu [v]        : with --realtime, pin to cpu v         ");
+	puts("  --fifo           : with --realtime, request SCHED_FIFO   ");
+	puts("  --bench_render [v]: compare stdio and frame output       ");
+	puts("  --bench_startup [v]: time exec to first stimulus, v runs ");
+	puts("  --help, -h, -?   : display this message                  ");
+}
+
+bool get_options(int argc, char *argv[], nback_options &out_options) {
+	bool success= true;
+	int getopt_code;
+	const char *const opt_string= "s:nh?";
+	int unused;
+	const struct option long_options[]= {
+		{ "cards",        no_argument,    &unused, 1 },
+		{ "test",         no_argument, &out_options.test_mode, 1 },
+		{ "random",       no_argument, &out_options.random_mode, 1 },
+		{ "no_history",   no_argument, 0, 'n' },
+		{ "guess_clear",  no_argument, &out_options.clear_buffer_on_guess, 1 },
+		{ "seconds",      required_argument, 0, 's' },
+		{ "max_n",        required_argument, 0, 'X' },
+		{ "timing",       no_argument, &out_options.print_timing, 1 },
+		{ "fast_start",   no_argument, &out_options.fast_start, 1 },
+		{ "fast-start",   no_argument, &out_options.fast_start, 1 },
+		{ "busy_poll",    no_argument, &out_options.busy_poll, 1 },
+		{ "coro",         no_argument, &out_options.coro_mode, 1 },
+		{ "realtime",     no_argument, &out_options.realtime_mode, 1 },
+		{ "fifo",         no_argument, &out_options.realtime_fifo, 1 },
+		{ "cpu",          required_argument, 0, 'c' },
+		{ "tui",          no_argument, &out_options.tui_mode, 1 },
+		{ "headless",     no_argument, &out_options.headless_mode, 1 },
+		{ "script",       required_argument, 0, 'S' },
+		{ "input_fd",     required_argument, 0, 'I' },
+		{ "bench_render", required_argument, 0, 'R' },
+		{ "bench_startup", required_argument, 0, 'B' },
+		{ "log",          required_argument, 0, 'L' },
+		{ "log_binary",   no_argument, &out_options.log_binary, 1 },
+		{ "serve",        required_argument, 0, 'U' },
+		{ "shards",       required_argument, 0, 'P' },
+		{ "prefork",      required_argument, 0, 'Y' },
+		{ "load",         required_argument, 0, 'O' },
+		{ "load_socket",  required_argument, 0, 'Q' },
+		{ "load_ramp",    required_argument, 0, 'W' },
+		{ "simulate",     required_argument, 0, 'M' },
+		{ "seed",         required_argument, 0, 'E' },
+		{ "sim_hit",      required_argument, 0, 'H' },
+		{ "sim_fa",       required_argument, 0, 'F' },
+		{ "sim_rt",       required_argument, 0, 'T' },
+		{ "sim_rt_sd",    required_argument, 0, 'D' },
+		{ "sim_trials",   required_argument, 0, 'N' },
+		{ "threads",      required_argument, 0, 'j' },
+		{ "sim_bank",     no_argument, &out_options.sim_bank, 1 },
+		{ "sim_kernel",   required_argument, 0, 'K' },
+		{ "sim_huge_pages", no_argument, &out_options.sim_huge_pages, 1 },
+		{ "help",         no_argument, 0, 'h' },
+		{ 0, 0, 0, 0}
+	};
+
+	out_options.clear();
+
+	do {
+		int option_index= 0;
+
+		getopt_code= getopt_long(argc, argv, opt_string, long_options, &option_index);
+
+		switch (getopt_code) {
+			case -1:
+				break;
+
+			case 0:
+				//TODO: What is this case? seems to relate to option_index being valid
+				break;
+				
+			case 'n':
+				out_options.print_buffer_on_guess= 0;
+				break;
+
+			case 's':
+				if (sscanf(optarg, "%d", &out_options.timeout_sec.value) != 0) {
+					out_options.timeout_sec.is_set= true;
+				} else {
+					puts("Option '-s' requires an integer value.");
+					success= false;
+				}
+				break;
+
+			case 'X':
+				if (sscanf(optarg, "%d", &out_options.max_n) != 1
+					|| out_options.max_n < 1 || out_options.max_n > max_deep_n) {
+					printf("Option '--max_n' requires a value from 1 to %d.\n", max_deep_n);
+					success= false;
+				}
+				break;
+
+			case 'c':
+				if (sscanf(optarg, "%d", &out_options.realtime_cpu.value) == 1
+					&& out_options.realtime_cpu.value >= 0
+					&& out_options.realtime_cpu.value < CPU_SETSIZE) {
+					out_options.realtime_cpu.is_set= true;
+				} else {
+					puts("Option '--cpu' requires a cpu index.");
+					success= false;
+				}
+				break;
+
+			case 'S':
+				out_options.headless_script= optarg;
+				break;
+
+			case 'I':
+				if (sscanf(optarg, "%d", &out_options.headless_fd.value) == 1
+					&& out_options.headless_fd.value >= 0) {
+					out_options.headless_fd.is_set= true;
+				} else {
+					puts("Option '--input_fd' requires a file descriptor.");
+					success= false;
+				}
+				break;
+
+			case 'L':
+				out_options.log_path= optarg;
+				break;
+
+			case 'U':
+				out_options.serve_path= optarg;
+				break;
+
+			case 'P':
+				if (sscanf(optarg, "%d", &out_options.server_shards) != 1
+					|| out_options.server_shards <= 0 || out_options.server_shards > 1024) {
+					puts("Option '--shards' requires a value from 1 to 1024.");
+					success= false;
+				}
+				break;
+
+			case 'Y':
+				if (sscanf(optarg, "%d", &out_options.prefork_workers) != 1
+					|| out_options.prefork_workers <= 0 || out_options.prefork_workers > 1024) {
+					puts("Option '--prefork' requires a value from 1 to 1024.");
+					success= false;
+				}
+				break;
+
+			case 'O':
+				if (sscanf(optarg, "%d", &out_options.load_trainees) != 1
+					|| out_options.load_trainees <= 0 || out_options.load_trainees > 100000) {
+					puts("Option '--load' requires a value from 1 to 100000.");
+					success= false;
+				}
+				break;
+
+			case 'Q':
+				out_options.load_socket_path= optarg;
+				break;
+
+			case 'W':
+				if (sscanf(optarg, "%d", &out_options.load_steps) != 1
+					|| out_options.load_steps <= 0 || out_options.load_steps > 1000) {
+					puts("Option '--load_ramp' requires a value from 1 to 1000.");
+					success= false;
+				}
+				break;
+
+			case 'M':
+				if (sscanf(optarg, "%lld", &out_options.simulate_sessions.value) == 1
+					&& out_options.simulate_sessions.value > 0) {
+					out_options.simulate_sessions.is_set= true;
+				} else {
+					puts("Option '--simulate' requires a session count.");
+					success= false;
+				}
+				break;
+
+			case 'E': {
+				unsigned long long seed;
+				if (sscanf(optarg, "%llu", &seed) == 1) {
+					out_options.seed= seed;
+				} else {
+					puts("Option '--seed' requires an integer value.");
+					success= false;
+				}
+				break;
+			}
+
+			case 'H':
+				if (!parse_hit_rates(optarg, out_options.player)) {
+					puts("Option '--sim_hit' requires rates from 0 to 1.");
+					success= false;
+				}
+				break;
+
+			case 'F':
+				if (sscanf(optarg, "%lf", &out_options.player.false_alarm_rate) != 1
+					|| out_options.player.false_alarm_rate < 0.0
+					|| out_options.player.false_alarm_rate > 1.0) {
+					puts("Option '--sim_fa' requires a rate from 0 to 1.");
+					success= false;
+				}
+				break;
+
+			case 'T':
+				if (sscanf(optarg, "%d", &out_options.player.rt_mean_msec) != 1
+					|| out_options.player.rt_mean_msec < 0) {
+					puts("Option '--sim_rt' requires milliseconds.");
+					success= false;
+				}
+				break;
+
+			case 'D':
+				if (sscanf(optarg, "%d", &out_options.player.rt_sd_msec) != 1
+					|| out_options.player.rt_sd_msec < 0) {
+					puts("Option '--sim_rt_sd' requires milliseconds.");
+					success= false;
+				}
+				break;
+
+			case 'N':
+				if (sscanf(optarg, "%d", &out_options.sim_trials) != 1 || out_options.sim_trials <= 0) {
+					puts("Option '--sim_trials' requires a trial count.");
+					success= false;
+				}
+				break;
+
+			case 'j':
+				if (sscanf(optarg, "%d", &out_options.sim_threads) != 1
+					|| out_options.sim_threads <= 0 || out_options.sim_threads > 1024) {
+					puts("Option '--threads' requires a value from 1 to 1024.");
+					success= false;
+				}
+				break;
+
+			case 'K':
+				out_options.sim_kernel= optarg;
+				break;
+
+			case 'R':
+				if (sscanf(optarg, "%d", &out_options.bench_render_trials.value) == 1
+					&& out_options.bench_render_trials.value > 0) {
+					out_options.bench_render_trials.is_set= true;
+				} else {
+					puts("Option '--bench_render' requires a trial count.");
+					success= false;
+				}
+				break;
+
+			case 'B':
+				if (sscanf(optarg, "%d", &out_options.bench_startup_runs.value) == 1
+					&& out_options.bench_startup_runs.value > 0) {
+					out_options.bench_startup_runs.is_set= true;
+				} else {
+					puts("Option '--bench_startup' requires a run count.");
+					success= false;
+				}
+				break;
+
+			case 'h':
+			case '?':
+				success= false;
+				break;
+
+			default:
+				abort ();
+		}
+	} while (getopt_code != -1);
+
+	return success;
+}
+
+// from a value_provider_factory slab or a session_arena
+template <typename t_allocator>
+i_nback_value_provider *create_value_provider(
+	t_allocator &allocator,
+	const nback_options &options,
+	nback_rng &rng) {
+
+#ifdef TEST_VALUE_PROVIDER_FACTORY_ASSERT
+	if (true) {
+		return allocator.template create<test_static_assert_value_provider>();
+	} else
+#endif // TEST_VALUE_PROVIDER_FACTORY_ASSERT
+	const int symbol_count= get_symbol_count(options.max_n);
+	if (options.test_mode) {
+		return allocator.template create<test_value_provider>();
+	} else if (options.random_mode) {
+		return allocator.template create<random_value_provider>(rng, symbol_count);
+	} else {
+		return allocator.template create<card_value_provider>(rng, symbol_count);
+	}
+}
+
+// interactive, headless and coroutine sessions draw from this stream
+nback_rng game_rng;
+
+const char *get_mode_name(const nback_options &options) {
+	return options.test_mode ? "test" : options.random_mode ? "random" : "cards";
+}
+
+const char *const banner_lines[]= {
+	"N-back is training for your brain.",
+	"Numbers are presented in sequence,",
+	"  and it's your job to identify",
+	"  how far (n) back that number"
+};
+const char *const banner_max_format= "  last appeared, to a max of %d.\n";
+
+void print_results(int fd, const nback_results &res) {
+	dprintf(fd, "correct: %d\n", res.correct);
+	dprintf(fd, "incorrect (w/ nback): %d\n", res.incorrect);
+	dprintf(fd, "incorrect (w/ no nback): %d\n", res.incorrect_no_nback);
+	dprintf(fd, "missed: %d\n", res.misses);
+}
+
+// print_results for output that goes out in frames
+void render_results(frame_buffer &frame, const nback_results &res) {
+	frame.append("correct: ");
+	frame.append_int(res.correct);
+	frame.append("\nincorrect (w/ nback): ");
+	frame.append_int(res.incorrect);
+	frame.append("\nincorrect (w/ no nback): ");
+	frame.append_int(res.incorrect_no_nback);
+	frame.append("\nmissed: ");
+	frame.append_int(res.misses);
+	frame.append_char('\n');
+}
+
+// Event log
+//
+// One record per trial. The game thread only copies the record into a
+// lock-free single producer ring; a writer thread formats and batches them
+// to disk. When the disk falls behind the ring fills and records are
+// dropped (and counted), the next stimulus is never delayed.
+
+struct trial_record {
+	// tells a server's concurrent sessions apart in one log. 0 for a
+	// session of its own, server connections count from 1
+	int session;
+	int trial;
+	int value;
+	int guess;
+	unsigned char guess_set;
+	unsigned char correct;
+	unsigned char has_nback;
+	unsigned char history_count;
+	// oldest first, the newest values of deeper histories
+	int history[max_session_n + 1];
+	// relative to the start of the session
+	long long onset_usec;
+	long long onset_lateness_usec;
+	// -1 without a guess
+	long long reaction_usec;
+};
+
+template<typename t_history>
+void fill_trial_record(
+	trial_record &out_record,
+	int session,
+	int trial,
+	const t_history &past,
+	bool has_nback,
+	const optional<int> &guess_back,
+	bool correct) {
+
+	// the binary log writes the record as is, padding and unused history
+	// included
+	memset(&out_record, 0, sizeof(out_record));
+	const int history_count= std::min(past.get_count(), (int)ARRAY_SIZE(out_record.history));
+	for (int i= 0; i < history_count; ++i) {
+		out_record.history[i]= past.get_back(history_count - 1 - i);
+	}
+
+	out_record.session= session;
+	out_record.trial= trial;
+	out_record.value= past.is_empty() ? 0 : out_record.history[history_count - 1];
+	out_record.guess= guess_back.is_set ? guess_back.value : 0;
+	out_record.guess_set= guess_back.is_set;
+	out_record.correct= correct;
+	out_record.has_nback= has_nback;
+	out_record.history_count= (unsigned char)history_count;
+	out_record.onset_usec= 0;
+	out_record.onset_lateness_usec= 0;
+	out_record.reaction_usec= -1;
+}
+
+void fill_trial_record_timing(trial_record &out_record, const nback_timing &timing, long long session_start_usec) {
+	out_record.onset_usec= timing.onset_usec - session_start_usec;
+	out_record.onset_lateness_usec= timing.last_onset_lateness_usec;
+	out_record.reaction_usec= out_record.guess_set ? timing.last_reaction_usec : -1;
+}
+
+class event_log {
+public:
+	enum e_format {
+		format_json,
+		format_binary
+	};
+
+private:
+	enum {
+		// power of two
+		ring_capacity= 4096,
+		json_batch_size= 64 * 1024,
+		max_json_record_len= 512,
+		idle_sleep_usec= 20 * usec_per_msec
+	};
+
+public:
+	event_log() : m_fd(-1), m_format(format_json), m_file_offset(0), m_write_failed(false), m_head(0), m_tail(0),
+		m_dropped(0), m_stop(false), m_records(0), m_json_batch(0) {}
+
+	~event_log() {
+		close();
+	}
+
+	inline bool is_open() const { return m_fd != -1; }
+	// records the ring had no room for or that could not be written
+	inline unsigned get_dropped() const { return m_dropped.load(); }
+
+	// what open() takes from the arena, alignment included
+	static size_t get_arena_size() {
+		return ring_capacity*sizeof(trial_record) + json_batch_size + alignof(trial_record);
+	}
+
+	// the ring and the json batch come out of the session's arena
+	bool open(const char *path, e_format format, session_arena &arena) {
+		m_records= arena.create_array<trial_record>(ring_capacity);
+		m_json_batch= arena.create_array<char>(json_batch_size);
+		if (!m_records || !m_json_batch) {
+			errno= ENOMEM;
+			return false;
+		}
+
+		m_fd= ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (m_fd == -1) {
+			return false;
+		}
+
+		m_format= format;
+		m_file_offset= 0;
+		m_write_failed= false;
+		if (m_format == format_binary) {
+			// magic and record size, so readers can check the layout
+			const char magic[8]= { 'N', 'B', 'K', 'L', 'O', 'G', '2', 0 };
+			const unsigned record_size= sizeof(trial_record);
+			iovec header[2]= { { (void*)magic, sizeof(magic) }, { (void*)&record_size, sizeof(record_size) } };
+			const ssize_t header_size= sizeof(magic) + sizeof(record_size);
+			const ssize_t written= pwritev(m_fd, header, 2, 0);
+			if (written != header_size) {
+				if (written >= 0) {
+					errno= EIO;
+				}
+				::close(m_fd);
+				m_fd= -1;
+				return false;
+			}
+			m_file_offset= header_size;
+		}
+
+		m_stop.store(false);
+		m_writer= std::thread(&event_log::writer_main, this);
+		return true;
+	}
+
+	// game thread only. never blocks.
+	void push(const trial_record &record) {
+		const unsigned head= m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) >= ring_capacity) {
+			++m_dropped;
+			return;
+		}
+
+		m_records[head & (ring_capacity - 1)]= record;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+
+	// for runs without stimulus timing (headless): waits for room instead
+	// of dropping
+	void push_lossless(const trial_record &record) {
+		while (m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_acquire) >= ring_capacity) {
+			m_wake.notify_one();
+			sched_yield();
+		}
+		push(record);
+	}
+
+	// writes out everything still queued
+	void close() {
+		if (m_fd != -1) {
+			m_stop.store(true);
+			m_wake.notify_one();
+			m_writer.join();
+			::close(m_fd);
+			m_fd= -1;
+		}
+	}
+
+private:
+	void writer_main() {
+		while (true) {
+			const bool stopping= m_stop.load();
+			if (write_pending() == 0) {
+				if (stopping) {
+					break;
+				}
+				// only a lossless producer or close() ever notify
+				std::unique_lock<std::mutex> lock(m_wake_mutex);
+				m_wake.wait_for(lock, std::chrono::microseconds(idle_sleep_usec));
+			}
+		}
+	}
+
+	// returns the number of records written
+	unsigned write_pending() {
+		const unsigned tail= m_tail.load(std::memory_order_relaxed);
+		const unsigned head= m_head.load(std::memory_order_acquire);
+		const unsigned count= head - tail;
+
+		if (count == 0) {
+			return 0;
+		}
+
+		if (m_format == format_binary) {
+			// straight from the ring: one or two contiguous runs
+			const unsigned first= tail & (ring_capacity - 1);
+			const unsigned first_count= count < ring_capacity - first ? count : ring_capacity - first;
+			iovec runs[2]= {
+				{ &m_records[first], first_count*sizeof(trial_record) },
+				{ &m_records[0], (count - first_count)*sizeof(trial_record) }
+			};
+			const size_t total= count*sizeof(trial_record);
+			const ssize_t written= pwritev(m_fd, runs, count > first_count ? 2 : 1, m_file_offset);
+			size_t done= written > 0 ? written : 0;
+
+			// a short write goes on from where it stopped, run by run
+			while (done < total && (written != -1 || errno == EINTR)) {
+				const bool in_first= done < runs[0].iov_len;
+				const char *from= in_first
+					? (const char*)runs[0].iov_base + done
+					: (const char*)runs[1].iov_base + (done - runs[0].iov_len);
+				const size_t len= in_first ? runs[0].iov_len - done : total - done;
+				const ssize_t more= pwrite(m_fd, from, len, m_file_offset + done);
+
+				if (more > 0) {
+					done+= more;
+				} else if (more == 0) {
+					errno= 0;
+					break;
+				} else if (errno != EINTR) {
+					break;
+				}
+			}
+			if (done < total) {
+				report_write_error();
+			}
+
+			// a torn record is overwritten by the next write
+			const unsigned records_written= done/sizeof(trial_record);
+			m_file_offset+= records_written*sizeof(trial_record);
+			m_dropped+= count - records_written;
+		} else {
+			int len= 0;
+			unsigned batch_records= 0;
+			for (unsigned i= 0; i < count; ++i) {
+				if (len > json_batch_size - max_json_record_len) {
+					write_json_batch(len, batch_records);
+					len= 0;
+					batch_records= 0;
+				}
+				len+= format_json_record(m_records[(tail + i) & (ring_capacity - 1)], m_json_batch + len);
+				++batch_records;
+			}
+			write_json_batch(len, batch_records);
+		}
+
+		m_tail.store(head, std::memory_order_release);
+		return count;
+	}
+
+	// a batch that does not make it to the file counts as dropped
+	void write_json_batch(int len, unsigned batch_records) {
+		if (!write_all(m_json_batch, len)) {
+			report_write_error();
+			m_dropped+= batch_records;
+		}
+	}
+
+	bool write_all(const char *data, int len) {
+		while (len > 0) {
+			const ssize_t written= write(m_fd, data, len);
+			if (written <= 0) {
+				if (written == -1 && errno == EINTR) {
+					continue;
+				}
+				return false;
+			}
+			data+= written;
+			len-= written;
+		}
+		return true;
+	}
+
+	// once, the dropped count at close says how much was lost
+	void report_write_error() {
+		if (!m_write_failed) {
+			fprintf(stderr, "event log: write failed: %s\n", errno ? strerror(errno) : "short write");
+			m_write_failed= true;
+		}
+	}
+
+	static int format_json_record(const trial_record &record, char *out) {
+		int len= sprintf(out,
+			"{\"session\":%d,\"trial\":%d,\"value\":%d,\"history\":[",
+			record.session, record.trial, record.value);
+		for (int i= 0; i < record.history_count; ++i) {
+			len+= sprintf(out + len, i ? ",%d" : "%d", record.history[i]);
+		}
+		if (record.guess_set) {
+			len+= sprintf(out + len, "],\"guess\":%d", record.guess);
+		} else {
+			len+= sprintf(out + len, "],\"guess\":null");
+		}
+		len+= sprintf(out + len,
+			",\"correct\":%s,\"has_nback\":%s,\"onset_usec\":%lld,"
+			"\"onset_lateness_usec\":%lld,\"reaction_usec\":%lld}\n",
+			record.correct ? "true" : "false", record.has_nback ? "true" : "false",
+			record.onset_usec, record.onset_lateness_usec, record.reaction_usec);
+		return len;
+	}
+
+	int m_fd;
+	e_format m_format;
+	off_t m_file_offset;
+	// writer thread only
+	bool m_write_failed;
+	std::atomic<unsigned> m_head;
+	std::atomic<unsigned> m_tail;
+	// both threads add to it
+	std::atomic<unsigned> m_dropped;
+	std::atomic<bool> m_stop;
+	std::thread m_writer;
+	std::mutex m_wake_mutex;
+	std::condition_variable m_wake;
+	trial_record *m_records;
+	char *m_json_batch;
+};
+
+void report_dropped_log_records(const event_log &log) {
+	if (log.get_dropped() != 0) {
+		fprintf(stderr, "event log: %u records dropped, the disk could not keep up or failed\n", log.get_dropped());
+	}
+}
+
+// The history of a session at depth t_max_n: fixed size rings up to
+// max_session_n, occurrence masks for max_deep_n beyond that. plain is for
+// sessions without a display, text for those that print it.
+template<int t_max_n, bool t_deep= (t_max_n > max_session_n)>
+struct session_history_t {
+	typedef ring_t<int, t_max_n + 1> plain;
+	typedef text_ring_t<t_max_n + 1> text;
+};
+
+template<int t_max_n>
+struct session_history_t<t_max_n, true> {
+	typedef occurrence_history_t<ring_t<int, t_max_n + 1> > plain;
+	typedef occurrence_history_t<text_ring_t<t_max_n + 1> > text;
+};
+
+// Headless sessions
+//
+// The game without a terminal: no banner, pauses or redraws. Each line of
+// the script answers one stimulus, either with a guess or, when it holds no
+// number ("" or "-"), by letting the stimulus time out. The session ends
+// with the deck or with the script, whichever runs out first. With nothing
+// to keep on time, the event log waits for room instead of dropping.
+
+struct headless_summary {
+	nback_results res;
+	int trials;
+	long long elapsed_usec;
+	// during the trial loop
+	long long heap_allocations;
+	// the session arena had no room, nothing was played
+	bool out_of_memory;
+};
+
+// reads the leading integer of a script line, like the interactive parser
+bool parse_script_guess(const char *line, int &out_guess) {
+	char *end;
+	const long value= strtol(line, &end, 10);
+	out_guess= (int)value;
+	return end != line;
+}
+
+// one script line into a fixed buffer. the rest of a longer line is skipped
+bool read_script_line(FILE *script, char *line, int line_capacity) {
+	if (!fgets(line, line_capacity, script)) {
+		return false;
+	}
+	if (!strchr(line, '\n')) {
+		int c;
+		while ((c= fgetc(script)) != EOF && c != '\n') {
+		}
+	}
+	return true;
+}
+
+template<int t_max_n>
+headless_summary run_headless_session_t(const nback_options &options, FILE *script, event_log *log, session_arena &arena) {
+	typedef typename session_history_t<t_max_n>::plain t_history;
+	const int max_script_line= 256;
+	headless_summary summary;
+	t_history *history= arena.create<t_history>();
+	char *line= arena.create_array<char>(max_script_line);
+	i_nback_value_provider *prov= create_value_provider(arena, options, game_rng);
+
+	memset(&summary, 0, sizeof(summary));
+	if (!history || !line || !prov) {
+		fputs("Session memory exhausted, the session cannot start\n", stderr);
+		summary.out_of_memory= true;
+		return summary;
+	}
+	t_history &past= *history;
+	set_history_max_n(past, options.max_n);
+
+	const long long start_allocations= heap_allocation_count;
+	const long long start_usec= monotonic_usec();
+	while (prov->has_next() && read_script_line(script, line, max_script_line)) {
+		optional<int> guess_back;
+		const uint64_t matches= nback_push_value_matches(past, prov->get_next_value());
+		const bool has_nback= matches != 0;
+
+		guess_back.is_set= parse_script_guess(line, guess_back.value);
+		const bool correct= nback_score_trial(summary.res, matches, guess_back);
+
+		if (log) {
+			trial_record record;
+			fill_trial_record(record, 0, summary.trials, past, has_nback, guess_back, correct);
+			log->push_lossless(record);
+		}
+		++summary.trials;
+
+		if (guess_back.is_set && options.clear_buffer_on_guess) {
+			past.clear();
+		}
+	}
+	summary.elapsed_usec= monotonic_usec() - start_usec;
+	summary.heap_allocations= heap_allocation_count - start_allocations;
+
+	return summary;
+}
+
+typedef headless_summary (*headless_session_fn)(const nback_options &, FILE *, event_log *, session_arena &);
+
+// one instantiation per --max_n up to max_session_n, then one for every deeper n
+const headless_session_fn headless_sessions[max_session_n + 1]= {
+	NULL,
+	&run_headless_session_t<1>, &run_headless_session_t<2>, &run_headless_session_t<3>, &run_headless_session_t<4>,
+	&run_headless_session_t<5>, &run_headless_session_t<6>, &run_headless_session_t<7>, &run_headless_session_t<8>,
+	&run_headless_session_t<9>, &run_headless_session_t<10>, &run_headless_session_t<11>, &run_headless_session_t<12>,
+	&run_headless_session_t<13>, &run_headless_session_t<14>, &run_headless_session_t<15>, &run_headless_session_t<16>
+};
+
+headless_summary run_headless_session(const nback_options &options, FILE *script, event_log *log, session_arena &arena) {
+	const headless_session_fn run= options.max_n <= max_session_n
+		? headless_sessions[options.max_n] : &run_headless_session_t<max_deep_n>;
+	return run(options, script, log, arena);
+}
+
+void print_headless_summary(int fd, const char *mode, const headless_summary &summary) {
+	dprintf(fd,
+		"{\"mode\":\"%s\",\"trials\":%d,\"correct\":%d,\"incorrect\":%d,"
+		"\"incorrect_no_nback\":%d,\"misses\":%d,\"elapsed_usec\":%lld,\"heap_allocations\":%lld}\n",
+		mode, summary.trials, summary.res.correct, summary.res.incorrect,
+		summary.res.incorrect_no_nback, summary.res.misses, summary.elapsed_usec,
+		summary.heap_allocations);
+}
+
+// Terminal sessions
+//
+// The game as a trainee plays it: stdin and stdout are the terminal (or a
+// socket standing in for one), with the banner, the pauses and the summary.
+
+// false if the session arena had no room for it
+template<int t_max_n>
+bool run_terminal_session_t(const nback_options &options, i_nback_value_provider *prov, session_arena &arena,
+	guess_reader &input, session_signals &signals, event_log *log) {
+
+	typedef typename session_history_t<t_max_n>::text t_history;
+	t_history *history= arena.create<t_history>();
+	if (!history || !prov) {
+		fputs("Session memory exhausted, the session cannot start\n", stderr);
+		return false;
+	}
+	t_history &past= *history;
+	set_history_max_n(past, options.max_n);
+	nback_results res= {0};
+	nback_timing timing;
+
+	timing.clear();
+	for (int i= 0; i < (int)ARRAY_SIZE(banner_lines); ++i) {
+		puts(banner_lines[i]);
+	}
+	printf(banner_max_format, options.max_n);
+	fflush(stdout);
+	if (!options.fast_start) {
+		signals.wait_usec(usec_per_sec, timing);
+	}
+	
+	if (!signals.is_shutdown_requested()) {
+		puts("Here we go!");
+		fflush(stdout);
+		if (!options.fast_start) {
+			signals.wait_usec(usec_per_sec, timing);
+		}
+	}
+
+	if (options.tui_mode) {
+		if (stdout_tui.enter(STDOUT_FILENO, options.max_n)) {
+			signals.set_screen(&stdout_tui);
+		} else {
+			fputs("--tui needs a terminal, using the line display\n", stderr);
+		}
+	}
+
+	const long long start_allocations= heap_allocation_count;
+	const long long start_usec= monotonic_usec();
+	for (int trial= 0; !signals.is_shutdown_requested() && prov->has_next(); ++trial) {
+		optional<int> guess_back;
+		int current_value;
+
+		timing.begin_trial();
+		current_value= prov->get_next_value();
+		const uint64_t matches= nback_push_value_matches(past, current_value);
+		const bool has_nback= matches != 0;
+		
+		guess_back.is_set= try_get_guess_with_timeout(
+			current_value, options.timeout_sec, options.busy_poll != 0,
+			input, signals, timing, guess_back.value);
+
+		if (signals.is_shutdown_requested()) {
+			break;
+		}
+
+		const bool correct= nback_score_trial(res, matches, guess_back);
+
+		if (log) {
+			trial_record record;
+			fill_trial_record(record, 0, trial, past, has_nback, guess_back, correct);
+			fill_trial_record_timing(record, timing, start_usec);
+			log->push(record);
+		}
+
+		if (guess_back.is_set) {
+			print_guess_verdict(past, options.print_buffer_on_guess != 0, correct, res);
+
+			if (options.clear_buffer_on_guess) {
+				past.clear();
+			}
+			signals.wait_usec(2*usec_per_sec, timing);
+		} else if (stdout_tui.is_active()) {
+			stdout_tui.set_results(res);
+		}
+	}
+
+	const long long trial_allocations= heap_allocation_count - start_allocations;
+	stdout_tui.leave();
+
+	if (signals.is_shutdown_requested()) {
+		puts("\n... Stopped early.");
+	} else {
+		puts("... That's all!");
+	}
+	
+	fflush(stdout);
+	print_results(STDOUT_FILENO, res);
+
+	if (options.print_timing) {
+		timing.onset_lateness.print("onset lateness");
+		timing.wakeup_lateness.print("wakeup lateness");
+		timing.reaction_time.print("reaction time");
+		printf("heap allocations in trial loop: %lld\n", trial_allocations);
+	}
+
+	if (options.busy_poll) {
+		printf("busy poll cpu: %lld usec over %lld usec waiting (%.0f%%)\n",
+			timing.busy_poll_cpu_usec, timing.busy_poll_wall_usec,
+			timing.busy_poll_wall_usec
+				? 100.0*timing.busy_poll_cpu_usec/timing.busy_poll_wall_usec
+				: 0.0);
+	}
+	return true;
+}
+
+typedef bool (*terminal_session_fn)(const nback_options &, i_nback_value_provider *, session_arena &,
+	guess_reader &, session_signals &, event_log *);
+
+// one instantiation per --max_n up to max_session_n, then one for every deeper n
+const terminal_session_fn terminal_sessions[max_session_n + 1]= {
+	NULL,
+	&run_terminal_session_t<1>, &run_terminal_session_t<2>, &run_terminal_session_t<3>, &run_terminal_session_t<4>,
+	&run_terminal_session_t<5>, &run_terminal_session_t<6>, &run_terminal_session_t<7>, &run_terminal_session_t<8>,
+	&run_terminal_session_t<9>, &run_terminal_session_t<10>, &run_terminal_session_t<11>, &run_terminal_session_t<12>,
+	&run_terminal_session_t<13>, &run_terminal_session_t<14>, &run_terminal_session_t<15>, &run_terminal_session_t<16>
+};
+
+// the history comes from the arena, sized for options.max_n
+bool run_terminal_session(const nback_options &options, i_nback_value_provider *prov, session_arena &arena,
+	guess_reader &input, session_signals &signals, event_log *log) {
+	const terminal_session_fn run= options.max_n <= max_session_n
+		? terminal_sessions[options.max_n] : &run_terminal_session_t<max_deep_n>;
+	return run(options, prov, arena, input, signals, log);
+}
+
+// Prefork server
+//
+// --serve path --prefork n: a process per session instead of a coroutine,
+// for builds without coroutines or where one session's crash must not end
+// the others. The supervisor keeps n workers warm: forked after the
+// self-tests and option parsing, with the deck already shuffled into the
+// session arena. An accepted connection (or any descriptor standing in for
+// a terminal) goes to an idle worker over its channel as SCM_RIGHTS; the
+// worker puts it on stdin and stdout, plays one session without the banner
+// pauses and exits. The supervisor forks its replacement as soon as the
+// connection is handed over, so n is the number of warm workers, not a cap
+// on sessions. Warm workers that die are replaced too, and counted.
+
+// every session holds a descriptor, and the default soft limit is often 1024
+void raise_fd_limit() {
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur= limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int open_server_socket(const char *path) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family= AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno= ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	const int fd= socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+
+	// a stale socket from an earlier run
+	unlink(path);
+	if (bind(fd, (const sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+		const int saved_errno= errno;
+		close(fd);
+		errno= saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+bool send_fd(int channel, int fd) {
+	char byte= 'f';
+	iovec part= { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	msghdr message;
+
+	memset(&message, 0, sizeof(message));
+	memset(control, 0, sizeof(control));
+	message.msg_iov= &part;
+	message.msg_iovlen= 1;
+	message.msg_control= control;
+	message.msg_controllen= sizeof(control);
+
+	cmsghdr *header= CMSG_FIRSTHDR(&message);
+	header->cmsg_level= SOL_SOCKET;
+	header->cmsg_type= SCM_RIGHTS;
+	header->cmsg_len= CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+	return sendmsg(channel, &message, MSG_NOSIGNAL) == 1;
+}
+
+// blocks until a descriptor arrives. -1 once the supervisor is gone
+int receive_fd(int channel) {
+	char byte;
+	iovec part= { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	msghdr message;
+
+	memset(&message, 0, sizeof(message));
+	message.msg_iov= &part;
+	message.msg_iovlen= 1;
+	message.msg_control= control;
+	message.msg_controllen= sizeof(control);
+
+	ssize_t read_result;
+	do {
+		read_result= recvmsg(channel, &message, MSG_CMSG_CLOEXEC);
+	} while (read_result == -1 && errno == EINTR);
+
+	cmsghdr *header= read_result == 1 ? CMSG_FIRSTHDR(&message) : NULL;
+	if (!header || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(header), sizeof(int));
+	return fd;
+}
+
+struct prefork_worker {
+	pid_t pid;
+	// the supervisor's end of the worker's socketpair, -1 for an empty slot
+	int channel;
+	bool idle;
+};
+
+struct prefork_stats {
+	long long sessions;
+	long long spawned;
+	// by workers playing a session or waiting for one
+	long long crashed;
+	long long hung_up;
+	long long dropped;
+	// socketpair or fork errors, the slot is tried again later
+	long long spawn_failures;
+};
+
+// the child side: everything up to the first stimulus that does not need
+// the trainee, then one session. never returns
+void run_prefork_worker(const nback_options &base_options, int channel, session_arena &arena) {
+	// the banner pauses would come after the hand-over, so they are left out
+	nback_options options= base_options;
+	options.fast_start= 1;
+
+	// a supervisor that dies leaves no idle workers behind
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	// the next write after a trainee hangs up ends the session
+	signal(SIGPIPE, SIG_DFL);
+	// forked workers would otherwise all deal the same deck
+	game_rng.reseed(nback_rng::mix((uint64_t)time(0)) ^ (uint64_t)getpid());
+
+	arena.reset();
+	i_nback_value_provider *prov= create_value_provider(arena, options, game_rng);
+	if (options.realtime_mode) {
+		enter_realtime_mode(options.realtime_cpu, options.realtime_fifo != 0);
+	}
+
+	const char ready= 'r';
+	const int fd= write(channel, &ready, 1) == 1 ? receive_fd(channel) : -1;
+	if (fd == -1) {
+		_exit(0);
+	}
+	close(channel);
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+
+	guess_reader input(STDIN_FILENO);
+	session_signals signals;
+	signals.open();
+	run_terminal_session(options, prov, arena, input, signals, NULL);
+	fflush(stdout);
+	_exit(0);
+}
+
+class prefork_supervisor {
+private:
+	enum {
+		// between attempts to fill slots whose spawn failed
+		spawn_retry_usec= usec_per_sec
+	};
+
+public:
+	prefork_supervisor(const nback_options &options, session_arena &arena, int worker_count)
+		: m_options(options), m_arena(arena), m_workers(worker_count), m_listen_fd(-1), m_signal_fd(-1),
+		m_spawn_retry_usec(-1) {
+
+		memset(&m_stats, 0, sizeof(m_stats));
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			m_workers[i].pid= -1;
+			m_workers[i].channel= -1;
+			m_workers[i].idle= false;
+		}
+	}
+
+	inline const prefork_stats &get_stats() const { return m_stats; }
+
+	// runs until SIGINT/SIGTERM. false if the server could not start
+	bool run(const char *path) {
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		sigaddset(&mask, SIGCHLD);
+		sigprocmask(SIG_BLOCK, &mask, &m_saved_mask);
+		m_signal_fd= signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+		m_listen_fd= open_server_socket(path);
+		if (m_signal_fd == -1 || m_listen_fd == -1) {
+			fprintf(stderr, "Cannot listen on '%s': %s\n", path, strerror(errno));
+			close_fds();
+			return false;
+		}
+
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			spawn(m_workers[i]);
+		}
+		printf("serving on %s with %d prefork workers\n", path, (int)m_workers.size());
+		fflush(stdout);
+
+		std::vector<pollfd> pfds;
+		for (bool stopping= false; !stopping;) {
+			pfds.clear();
+			pollfd signal_pfd= { m_signal_fd, POLLIN, 0 };
+			pfds.push_back(signal_pfd);
+			// connections wait in the backlog until a warm worker is ready
+			if (get_idle_worker()) {
+				pollfd listen_pfd= { m_listen_fd, POLLIN, 0 };
+				pfds.push_back(listen_pfd);
+			}
+			for (size_t i= 0; i < m_workers.size(); ++i) {
+				if (m_workers[i].channel != -1 && !m_workers[i].idle) {
+					pollfd channel_pfd= { m_workers[i].channel, POLLIN, 0 };
+					pfds.push_back(channel_pfd);
+				}
+			}
+
+			if (poll(&pfds[0], pfds.size(), get_spawn_retry_timeout_msec()) == -1) {
+				continue;
+			}
+			if (m_spawn_retry_usec != -1 && monotonic_usec() >= m_spawn_retry_usec) {
+				spawn_missing_workers();
+			}
+			for (size_t i= 0; i < pfds.size(); ++i) {
+				if (!pfds[i].revents) {
+					continue;
+				}
+				if (pfds[i].fd == m_signal_fd) {
+					stopping= !process_signals();
+				} else if (pfds[i].fd == m_listen_fd) {
+					accept_sessions();
+				} else {
+					mark_ready(pfds[i].fd);
+				}
+			}
+		}
+
+		close(m_listen_fd);
+		m_listen_fd= -1;
+		unlink(path);
+		stop_workers();
+		close_fds();
+		return true;
+	}
+
+private:
+	// a slot left empty by a failed spawn is tried again after a while
+	void spawn(prefork_worker &worker) {
+		if (!try_spawn(worker)) {
+			m_stats.spawn_failures++;
+			if (m_spawn_retry_usec == -1) {
+				m_spawn_retry_usec= monotonic_usec() + spawn_retry_usec;
+			}
+		}
+	}
+
+	void spawn_missing_workers() {
+		m_spawn_retry_usec= -1;
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			if (m_workers[i].pid == -1) {
+				spawn(m_workers[i]);
+			}
+		}
+	}
+
+	// -1 (none) unless a slot is waiting for its retry
+	int get_spawn_retry_timeout_msec() const {
+		if (m_spawn_retry_usec == -1) {
+			return -1;
+		}
+		const long long wait_usec= m_spawn_retry_usec - monotonic_usec();
+		return wait_usec > 0 ? (int)((wait_usec + usec_per_msec - 1)/usec_per_msec) : 0;
+	}
+
+	bool try_spawn(prefork_worker &worker) {
+		int channel[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) != 0) {
+			fprintf(stderr, "Cannot create worker channel: %s\n", strerror(errno));
+			return false;
+		}
+		// nothing buffered may be written twice
+		fflush(NULL);
+
+		const pid_t pid= fork();
+		if (pid == 0) {
+			close(m_listen_fd);
+			close(m_signal_fd);
+			for (size_t i= 0; i < m_workers.size(); ++i) {
+				if (m_workers[i].channel != -1) {
+					close(m_workers[i].channel);
+				}
+			}
+			close(channel[0]);
+			sigprocmask(SIG_SETMASK, &m_saved_mask, NULL);
+			run_prefork_worker(m_options, channel[1], m_arena);
+		}
+
+		close(channel[1]);
+		if (pid == -1) {
+			fprintf(stderr, "Cannot fork worker: %s\n", strerror(errno));
+			close(channel[0]);
+			return false;
+		}
+		worker.pid= pid;
+		worker.channel= channel[0];
+		worker.idle= false;
+		m_stats.spawned++;
+		return true;
+	}
+
+	prefork_worker *get_idle_worker() {
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			if (m_workers[i].idle) {
+				return &m_workers[i];
+			}
+		}
+		return NULL;
+	}
+
+	// the worker's ready byte, or the end of its channel
+	void mark_ready(int channel) {
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			prefork_worker &worker= m_workers[i];
+			if (worker.channel == channel) {
+				char ready;
+				const ssize_t read_result= read(channel, &ready, 1);
+				if (read_result == 1) {
+					worker.idle= true;
+				} else if (read_result == 0) {
+					// gone; SIGCHLD brings the replacement
+					close(worker.channel);
+					worker.channel= -1;
+				}
+				return;
+			}
+		}
+	}
+
+	void accept_sessions() {
+		for (prefork_worker *worker= get_idle_worker(); worker; worker= get_idle_worker()) {
+			const int fd= accept4(m_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd == -1) {
+				return;
+			}
+			// a worker that died since it was ready is skipped
+			while (worker && !send_fd(worker->channel, fd)) {
+				worker->idle= false;
+				worker= get_idle_worker();
+			}
+			close(fd);
+
+			if (!worker) {
+				m_stats.dropped++;
+				return;
+			}
+			// the worker now owns the session and exits at its end. the slot
+			// gets a new warm worker right away
+			m_playing.push_back(worker->pid);
+			close(worker->channel);
+			worker->pid= -1;
+			worker->channel= -1;
+			worker->idle= false;
+			m_stats.sessions++;
+			spawn(*worker);
+		}
+	}
+
+	// reaps and replaces workers. false on a shutdown request
+	bool process_signals() {
+		bool keep_running= true;
+		signalfd_siginfo info;
+
+		while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+			if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+				keep_running= false;
+			}
+		}
+
+		int status;
+		pid_t pid;
+		while ((pid= waitpid(-1, &status, WNOHANG)) > 0) {
+			if (remove_playing(pid)) {
+				count_exit(status);
+				continue;
+			}
+			prefork_worker *worker= find_worker(pid);
+			if (!worker) {
+				continue;
+			}
+			count_exit(status);
+			if (worker->channel != -1) {
+				close(worker->channel);
+			}
+			worker->pid= -1;
+			worker->channel= -1;
+			worker->idle= false;
+			if (keep_running) {
+				spawn(*worker);
+			}
+		}
+		return keep_running;
+	}
+
+	void count_exit(int status) {
+		if (WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE) {
+			m_stats.hung_up++;
+		} else if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0)) {
+			m_stats.crashed++;
+		}
+	}
+
+	// false if pid is not playing a session
+	bool remove_playing(pid_t pid) {
+		for (size_t i= 0; i < m_playing.size(); ++i) {
+			if (m_playing[i] == pid) {
+				m_playing[i]= m_playing.back();
+				m_playing.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	prefork_worker *find_worker(pid_t pid) {
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			if (m_workers[i].pid == pid) {
+				return &m_workers[i];
+			}
+		}
+		return NULL;
+	}
+
+	// idle workers just exit; playing ones end their session early, as the
+	// coroutine server's do
+	void stop_workers() {
+		for (size_t i= 0; i < m_playing.size(); ++i) {
+			kill(m_playing[i], SIGTERM);
+		}
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			if (m_workers[i].pid > 0) {
+				kill(m_workers[i].pid, SIGTERM);
+			}
+		}
+		for (size_t i= 0; i < m_workers.size(); ++i) {
+			if (m_workers[i].pid > 0) {
+				waitpid(m_workers[i].pid, NULL, 0);
+			}
+			if (m_workers[i].channel != -1) {
+				close(m_workers[i].channel);
+				m_workers[i].channel= -1;
+			}
+		}
+		while (waitpid(-1, NULL, 0) > 0) {
+		}
+		m_playing.clear();
+	}
+
+	void close_fds() {
+		if (m_listen_fd != -1) {
+			close(m_listen_fd);
+			m_listen_fd= -1;
+		}
+		if (m_signal_fd != -1) {
+			close(m_signal_fd);
+			m_signal_fd= -1;
+		}
+		sigprocmask(SIG_SETMASK, &m_saved_mask, NULL);
+	}
+
+	const nback_options &m_options;
+	session_arena &m_arena;
+	// warm slots, and the pids of workers that have left them for a session
+	std::vector<prefork_worker> m_workers;
+	std::vector<pid_t> m_playing;
+	int m_listen_fd;
+	int m_signal_fd;
+	// when spawn_missing_workers runs next, -1 while every slot has a worker
+	long long m_spawn_retry_usec;
+	sigset_t m_saved_mask;
+	prefork_stats m_stats;
+};
+
+int run_prefork_server(const nback_options &options, const char *path, session_arena &arena) {
+	prefork_supervisor supervisor(options, arena, options.prefork_workers);
+
+	// a trainee that hangs up must not take the supervisor with it
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
+	if (!supervisor.run(path)) {
+		return 1;
+	}
+
+	const prefork_stats &stats= supervisor.get_stats();
+	printf("sessions: %lld handed to workers, %lld dropped\n", stats.sessions, stats.dropped);
+	printf("workers: %lld started, %lld crashed, %lld ended by a hang-up\n",
+		stats.spawned, stats.crashed, stats.hung_up);
+	if (stats.spawn_failures) {
+		printf("worker starts that failed and were retried: %lld\n", stats.spawn_failures);
+	}
+	return 0;
+}
+
+// Simulation
+//
+// Sessions played by synthetic players against the real providers, ring_t
+// and scoring code, on a virtual clock: a trial costs the player's reaction
+// time (or the whole timeout) plus the pause after a guess, but no real time
+// passes. Session i always plays with the stream seeded from (seed, i).
+
+struct sim_stats {
+	nback_results res;
+	long long sessions;
+	long long trials;
+	long long false_alarms;
+	long long slow_guesses;
+	long long virtual_usec;
+	// made by the workers while simulating, should stay 0
+	long long heap_allocations;
+	// not played, the worker's arena had no room for them
+	long long out_of_memory_sessions;
+	// by the nearest n of the trial's n-back, index n
+	long long opportunities[max_sim_n + 1];
+	long long hits[max_sim_n + 1];
+
+	void clear() {
+		memset(this, 0, sizeof(*this));
+	}
+
+	void merge(const sim_stats &other) {
+		res.correct+= other.res.correct;
+		res.incorrect+= other.res.incorrect;
+		res.incorrect_no_nback+= other.res.incorrect_no_nback;
+		res.misses+= other.res.misses;
+		sessions+= other.sessions;
+		trials+= other.trials;
+		false_alarms+= other.false_alarms;
+		slow_guesses+= other.slow_guesses;
+		virtual_usec+= other.virtual_usec;
+		heap_allocations+= other.heap_allocations;
+		out_of_memory_sessions+= other.out_of_memory_sessions;
+		for (int n= 0; n <= max_sim_n; ++n) {
+			opportunities[n]+= other.opportunities[n];
+			hits[n]+= other.hits[n];
+		}
+	}
+};
+
+struct sim_lane_kernel;
+
+// the player and session settings in the form the trial loop wants them:
+// probabilities as 32 bit thresholds, times in usec
+struct sim_setup {
+	uint32_t hit_threshold[max_sim_n + 1];
+	uint32_t false_alarm_threshold;
+	long long rt_mean_usec;
+	long long rt_sd_usec;
+	long long timeout_usec;
+	long long post_guess_usec;
+	long long intro_usec;
+	int max_trials;
+	bool clear_on_guess;
+	bool use_bank;
+	bool huge_pages;
+	const sim_lane_kernel *lane_kernel;
+	uint64_t seed;
+	const nback_options *options;
+};
+
+inline uint32_t probability_threshold(double probability) {
+	if (probability <= 0.0) {
+		return 0;
+	}
+	if (probability >= 1.0) {
+		return 0xffffffffu;
+	}
+	return (uint32_t)(probability*4294967296.0);
+}
+
+void prepare_sim_setup(sim_setup &out_setup, const nback_options &options, const synthetic_player &player) {
+	for (int n= 0; n <= max_sim_n; ++n) {
+		out_setup.hit_threshold[n]= probability_threshold(player.hit_rate[n]);
+	}
+	out_setup.false_alarm_threshold= probability_threshold(player.false_alarm_rate);
+	out_setup.rt_mean_usec= (long long)player.rt_mean_msec*usec_per_msec;
+	out_setup.rt_sd_usec= (long long)player.rt_sd_msec*usec_per_msec;
+	out_setup.timeout_usec= (long long)get_guess_timeout_sec(options.timeout_sec)*usec_per_sec;
+	out_setup.post_guess_usec= 2*usec_per_sec;
+	out_setup.intro_usec= 2*usec_per_sec;
+	out_setup.max_trials= options.sim_trials;
+	out_setup.clear_on_guess= options.clear_buffer_on_guess != 0;
+	out_setup.use_bank= options.sim_bank != 0 || options.sim_kernel != 0;
+	out_setup.lane_kernel= 0;
+	out_setup.huge_pages= options.sim_huge_pages != 0;
+	out_setup.seed= options.seed;
+	out_setup.options= &options;
+}
+
+// roughly normal reaction time from 64 random bits: the sum of four 16 bit
+// uniforms (Irwin-Hall), scaled to unit variance
+inline long long sample_reaction_usec(const sim_setup &setup, uint64_t bits) {
+	const long long sum= (long long)(bits & 0xffff) + ((bits >> 16) & 0xffff)
+		+ ((bits >> 32) & 0xffff) + (bits >> 48);
+	// (sum/65536 - 2)*sqrt(3), sqrt(3) ~ 1.732 ~ 28378/16384
+	const long long z_q16= ((sum - 2*65536)*28378) >> 14;
+	const long long rt_usec= setup.rt_mean_usec + ((setup.rt_sd_usec*z_q16) >> 16);
+	return rt_usec > 0 ? rt_usec : 0;
+}
+
+inline uint64_t get_session_seed(uint64_t seed, uint64_t session_index) {
+	return nback_rng::mix(seed ^ nback_rng::mix(session_index));
+}
+
+void simulate_session(const sim_setup &setup, uint64_t session_index, sim_stats &stats, session_arena &arena) {
+	const size_t arena_mark= arena.get_used();
+	nback_rng rng(get_session_seed(setup.seed, session_index));
+	n_back_buffer *history= arena.create<n_back_buffer>();
+	i_nback_value_provider *prov= create_value_provider(arena, *setup.options, rng);
+	if (!history || !prov) {
+		stats.out_of_memory_sessions++;
+		arena.rewind(arena_mark);
+		return;
+	}
+	n_back_buffer &past= *history;
+	long long virtual_usec= setup.intro_usec;
+	int trial= 0;
+
+	for (; trial < setup.max_trials && prov->has_next(); ++trial) {
+		optional<int> guess_back= { false, 0 };
+		const uint64_t matches= nback_push_value_matches(past, prov->get_next_value());
+		const bool has_nback= matches != 0;
+		const int nearest= nback_mask_nearest_back(matches);
+		const uint64_t bits= rng.next();
+		const uint32_t decision= (uint32_t)bits;
+
+		if (has_nback) {
+			stats.opportunities[nearest]++;
+			if (decision < setup.hit_threshold[nearest]) {
+				guess_back.is_set= true;
+				guess_back.value= nearest;
+			}
+		} else if (decision < setup.false_alarm_threshold) {
+			guess_back.is_set= true;
+			guess_back.value= 1 + (int)nback_rng::scale(bits, max_sim_n);
+		}
+
+		long long trial_usec= setup.timeout_usec;
+		if (guess_back.is_set) {
+			const long long rt_usec= sample_reaction_usec(setup, rng.next());
+			if (rt_usec < setup.timeout_usec) {
+				trial_usec= rt_usec + setup.post_guess_usec;
+			} else {
+				guess_back.is_set= false;
+				stats.slow_guesses++;
+			}
+		}
+		virtual_usec+= trial_usec;
+
+		const bool correct= nback_score_trial(stats.res, matches, guess_back);
+		if (correct) {
+			stats.hits[nearest]++;
+		} else if (guess_back.is_set && !has_nback) {
+			stats.false_alarms++;
+		}
+
+		if (guess_back.is_set && setup.clear_on_guess) {
+			past.clear();
+		}
+	}
+
+	stats.sessions++;
+	stats.trials+= trial;
+	stats.virtual_usec+= virtual_usec;
+	arena.rewind(arena_mark);
+}
+
+// Packed histories: 4 bits per value (1..10, so 0 is empty), newest in the
+// low nibble, as many values as an n_back_buffer holds.
+const int packed_history_values= n_back_buffer::my_size;
+static_assert(get_symbol_count(n_back_buffer::my_size - 1) < 16, "values fit a nibble");
+const uint32_t packed_history_mask= (1u << 4*packed_history_values) - 1;
+const uint32_t packed_nibble_ones= 0x11111111u & packed_history_mask;
+const uint32_t packed_nibble_highs= 0x88888888u & packed_history_mask;
+
+inline uint32_t packed_history_push(uint32_t history, uint32_t value) {
+	return ((history << 4) | value) & packed_history_mask;
+}
+
+// bit 4n+3 set where the value n back equals the head. the usual zero nibble
+// trick: the head nibble is forced non-zero, and a borrow can only flag
+// nibbles above a real match, so the lowest flag is always exact
+inline uint32_t packed_history_match_flags(uint32_t history) {
+	const uint32_t x= (history ^ ((history & 15)*packed_nibble_ones)) | 15;
+	return (x - packed_nibble_ones) & ~x & packed_nibble_highs;
+}
+
+// the smallest n at which the head value appeared before, 0 if none
+inline int packed_history_nearest_back(uint32_t history) {
+	const uint32_t flags= packed_history_match_flags(history);
+	return flags ? __builtin_ctz(flags) >> 2 : 0;
+}
+
+inline bool packed_history_is_guess_correct(uint32_t history, int guess_back) {
+	return guess_back > 0 && guess_back < packed_history_values
+		&& ((history >> 4*guess_back) & 15) == (history & 15);
+}
+
+// The per-session columns a lane kernel works on. A trial step is split in
+// two kernel passes around the reaction times, which still come from each
+// session's own random stream:
+//   classify: push the value, find the nearest n-back, decide the guess
+//   score:    count the guess into the counters, clear on guess
+struct sim_lanes {
+	enum {
+		capacity= 256
+	};
+
+	// inputs of classify
+	alignas(64) uint32_t value[capacity];
+	alignas(64) uint32_t decision[capacity];
+	alignas(64) uint32_t false_alarm_pick[capacity];
+	// state and outputs
+	alignas(64) uint32_t history[capacity];
+	alignas(64) uint32_t nearest[capacity];
+	alignas(64) uint32_t guess[capacity];
+	// counters
+	alignas(64) uint32_t correct[capacity];
+	alignas(64) uint32_t incorrect[capacity];
+	alignas(64) uint32_t incorrect_no_nback[capacity];
+	alignas(64) uint32_t misses[capacity];
+	alignas(64) uint32_t false_alarms[capacity];
+	// by nearest n, index 0 soaks up the trials without an n-back
+	alignas(64) uint32_t opportunities[max_sim_n + 1][capacity];
+	alignas(64) uint32_t hits[max_sim_n + 1][capacity];
+
+	void clear() {
+		memset(this, 0, sizeof(*this));
+	}
+};
+
+struct sim_lane_params {
+	// by nearest n, padded for a 16 lane table lookup
+	uint32_t hit_threshold[16];
+	uint32_t false_alarm_threshold;
+	bool clear_on_guess;
+};
+
+// the reference the vector kernels are checked against
+void sim_classify_lanes_scalar(sim_lanes &lanes, const sim_lane_params &params, int count) {
+	for (int s= 0; s < count; ++s) {
+		const uint32_t history= packed_history_push(lanes.history[s], lanes.value[s]);
+		const int nearest= packed_history_nearest_back(history);
+		const uint32_t decision= lanes.decision[s];
+		uint32_t guess= 0;
+
+		if (nearest) {
+			guess= decision < params.hit_threshold[nearest] ? nearest : 0;
+		} else if (decision < params.false_alarm_threshold) {
+			guess= lanes.false_alarm_pick[s];
+		}
+
+		lanes.history[s]= history;
+		lanes.nearest[s]= nearest;
+		lanes.guess[s]= guess;
+	}
+}
+
+void sim_score_lanes_scalar(sim_lanes &lanes, const sim_lane_params &params, int count) {
+	for (int s= 0; s < count; ++s) {
+		const uint32_t history= lanes.history[s];
+		const uint32_t nearest= lanes.nearest[s];
+		const uint32_t guess= lanes.guess[s];
+		const bool has_nback= nearest != 0;
+		const bool correct= packed_history_is_guess_correct(history, guess);
+
+		lanes.correct[s]+= correct;
+		lanes.incorrect[s]+= guess && !correct && has_nback;
+		lanes.incorrect_no_nback[s]+= guess && !has_nback;
+		lanes.false_alarms[s]+= guess && !has_nback;
+		lanes.misses[s]+= !guess && has_nback;
+		lanes.opportunities[nearest][s]+= has_nback;
+		lanes.hits[nearest][s]+= correct;
+
+		if (guess && params.clear_on_guess) {
+			lanes.history[s]= 0;
+		}
+	}
+}
+
+#ifdef NBACK_HAS_LANE_KERNELS
+// 8 sessions per instruction. unsigned compares are signed ones on values
+// with the top bit flipped; the nearest n comes from the float exponent of
+// the lowest match flag
+__attribute__((target("avx2")))
+void sim_classify_lanes_avx2(sim_lanes &lanes, const sim_lane_params &params, int count) {
+	const __m256i zero= _mm256_setzero_si256();
+	const __m256i fifteen= _mm256_set1_epi32(15);
+	const __m256i sign= _mm256_set1_epi32((int)0x80000000u);
+	const __m256i ones= _mm256_set1_epi32((int)packed_nibble_ones);
+	const __m256i highs= _mm256_set1_epi32((int)packed_nibble_highs);
+	const __m256i history_mask= _mm256_set1_epi32((int)packed_history_mask);
+	const __m256i exponent_bias= _mm256_set1_epi32(127 + 3);
+	const __m256i hit_threshold= _mm256_xor_si256(sign,
+		_mm256_loadu_si256((const __m256i *)params.hit_threshold));
+	const __m256i false_alarm_threshold= _mm256_set1_epi32((int)(params.false_alarm_threshold ^ 0x80000000u));
+
+	for (int s= 0; s < count; s+= 8) {
+		const __m256i value= _mm256_load_si256((const __m256i *)&lanes.value[s]);
+		const __m256i history= _mm256_and_si256(history_mask,
+			_mm256_or_si256(_mm256_slli_epi32(_mm256_load_si256((const __m256i *)&lanes.history[s]), 4), value));
+
+		const __m256i x= _mm256_or_si256(fifteen,
+			_mm256_xor_si256(history, _mm256_mullo_epi32(value, ones)));
+		const __m256i flags= _mm256_and_si256(highs,
+			_mm256_andnot_si256(x, _mm256_sub_epi32(x, ones)));
+		const __m256i lowest= _mm256_and_si256(flags, _mm256_sub_epi32(zero, flags));
+		const __m256i has_nback= _mm256_xor_si256(_mm256_cmpeq_epi32(flags, zero), _mm256_set1_epi32(-1));
+		const __m256i exponent= _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(lowest)), 23);
+		const __m256i nearest= _mm256_and_si256(has_nback,
+			_mm256_srli_epi32(_mm256_sub_epi32(exponent, exponent_bias), 2));
+
+		const __m256i decision= _mm256_xor_si256(sign, _mm256_load_si256((const __m256i *)&lanes.decision[s]));
+		const __m256i hit= _mm256_cmpgt_epi32(_mm256_permutevar8x32_epi32(hit_threshold, nearest), decision);
+		const __m256i false_alarm= _mm256_cmpgt_epi32(false_alarm_threshold, decision);
+		const __m256i guess= _mm256_blendv_epi8(
+			_mm256_and_si256(false_alarm, _mm256_load_si256((const __m256i *)&lanes.false_alarm_pick[s])),
+			_mm256_and_si256(hit, nearest),
+			has_nback);
+
+		_mm256_store_si256((__m256i *)&lanes.history[s], history);
+		_mm256_store_si256((__m256i *)&lanes.nearest[s], nearest);
+		_mm256_store_si256((__m256i *)&lanes.guess[s], guess);
+	}
+}
+
+// compares give all ones, so subtracting one is a masked increment
+__attribute__((target("avx2")))
+inline void masked_count_avx2(uint32_t *counter, __m256i mask) {
+	__m256i *slot= (__m256i *)counter;
+	_mm256_store_si256(slot, _mm256_sub_epi32(_mm256_load_si256(slot), mask));
+}
+
+__attribute__((target("avx2")))
+void sim_score_lanes_avx2(sim_lanes &lanes, const sim_lane_params &params, int count) {
+	const __m256i zero= _mm256_setzero_si256();
+	const __m256i all= _mm256_set1_epi32(-1);
+	const __m256i fifteen= _mm256_set1_epi32(15);
+
+	for (int s= 0; s < count; s+= 8) {
+		const __m256i value= _mm256_load_si256((const __m256i *)&lanes.value[s]);
+		const __m256i history= _mm256_load_si256((const __m256i *)&lanes.history[s]);
+		const __m256i nearest= _mm256_load_si256((const __m256i *)&lanes.nearest[s]);
+		const __m256i guess= _mm256_load_si256((const __m256i *)&lanes.guess[s]);
+		const __m256i guessed= _mm256_xor_si256(all, _mm256_cmpeq_epi32(guess, zero));
+		const __m256i has_nback= _mm256_xor_si256(all, _mm256_cmpeq_epi32(nearest, zero));
+		const __m256i at_guess= _mm256_and_si256(fifteen,
+			_mm256_srlv_epi32(history, _mm256_slli_epi32(guess, 2)));
+		const __m256i correct= _mm256_and_si256(guessed, _mm256_cmpeq_epi32(at_guess, value));
+
+		masked_count_avx2(&lanes.correct[s], correct);
+		masked_count_avx2(&lanes.incorrect[s], _mm256_andnot_si256(correct, _mm256_and_si256(guessed, has_nback)));
+		masked_count_avx2(&lanes.incorrect_no_nback[s], _mm256_andnot_si256(has_nback, guessed));
+		masked_count_avx2(&lanes.false_alarms[s], _mm256_andnot_si256(has_nback, guessed));
+		masked_count_avx2(&lanes.misses[s], _mm256_andnot_si256(guessed, has_nback));
+		for (int n= 1; n <= max_sim_n; ++n) {
+			const __m256i at_n= _mm256_cmpeq_epi32(nearest, _mm256_set1_epi32(n));
+			masked_count_avx2(&lanes.opportunities[n][s], at_n);
+			masked_count_avx2(&lanes.hits[n][s], _mm256_and_si256(at_n, correct));
+		}
+
+		if (params.clear_on_guess) {
+			_mm256_store_si256((__m256i *)&lanes.history[s], _mm256_andnot_si256(guessed, history));
+		}
+	}
+}
+
+// 16 sessions per instruction, with real unsigned compares and mask registers.
+// gcc 12's avx512 headers trip -Wmaybe-uninitialized on their own
+// _mm512_undefined_epi32() passthroughs (gcc PR 105593)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+void sim_classify_lanes_avx512(sim_lanes &lanes, const sim_lane_params &params, int count) {
+	const __m512i zero= _mm512_setzero_si512();
+	const __m512i fifteen= _mm512_set1_epi32(15);
+	const __m512i ones= _mm512_set1_epi32((int)packed_nibble_ones);
+	const __m512i highs= _mm512_set1_epi32((int)packed_nibble_highs);
+	const __m512i history_mask= _mm512_set1_epi32((int)packed_history_mask);
+	const __m512i exponent_bias= _mm512_set1_epi32(127 + 3);
+	const __m512i hit_threshold= _mm512_loadu_si512(params.hit_threshold);
+	const __m512i false_alarm_threshold= _mm512_set1_epi32((int)params.false_alarm_threshold);
+
+	for (int s= 0; s < count; s+= 16) {
+		const __m512i value= _mm512_load_si512(&lanes.value[s]);
+		const __m512i history= _mm512_and_si512(history_mask,
+			_mm512_or_si512(_mm512_slli_epi32(_mm512_load_si512(&lanes.history[s]), 4), value));
+
+		const __m512i x= _mm512_or_si512(fifteen,
+			_mm512_xor_si512(history, _mm512_mullo_epi32(value, ones)));
+		const __m512i flags= _mm512_and_si512(highs,
+			_mm512_andnot_si512(x, _mm512_sub_epi32(x, ones)));
+		const __m512i lowest= _mm512_and_si512(flags, _mm512_sub_epi32(zero, flags));
+		const __mmask16 has_nback= _mm512_test_epi32_mask(flags, flags);
+		const __m512i exponent= _mm512_srli_epi32(_mm512_castps_si512(_mm512_cvtepi32_ps(lowest)), 23);
+		const __m512i nearest= _mm512_maskz_srli_epi32(has_nback, _mm512_sub_epi32(exponent, exponent_bias), 2);
+
+		const __m512i decision= _mm512_load_si512(&lanes.decision[s]);
+		const __mmask16 hit= has_nback
+			& _mm512_cmplt_epu32_mask(decision, _mm512_permutexvar_epi32(nearest, hit_threshold));
+		const __mmask16 false_alarm= ~has_nback
+			& _mm512_cmplt_epu32_mask(decision, false_alarm_threshold);
+		const __m512i guess= _mm512_mask_mov_epi32(
+			_mm512_maskz_mov_epi32(false_alarm, _mm512_load_si512(&lanes.false_alarm_pick[s])),
+			hit, nearest);
+
+		_mm512_store_si512(&lanes.history[s], history);
+		_mm512_store_si512(&lanes.nearest[s], nearest);
+		_mm512_store_si512(&lanes.guess[s], guess);
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void masked_count_avx512(uint32_t *counter, __mmask16 mask) {
+	const __m512i current= _mm512_load_si512(counter);
+	_mm512_store_si512(counter, _mm512_mask_add_epi32(current, mask, current, _mm512_set1_epi32(1)));
+}
+
+__attribute__((target("avx512f")))
+void sim_score_lanes_avx512(sim_lanes &lanes, const sim_lane_params &params, int count) {
+	const __m512i fifteen= _mm512_set1_epi32(15);
+
+	for (int s= 0; s < count; s+= 16) {
+		const __m512i value= _mm512_load_si512(&lanes.value[s]);
+		const __m512i history= _mm512_load_si512(&lanes.history[s]);
+		const __m512i nearest= _mm512_load_si512(&lanes.nearest[s]);
+		const __m512i guess= _mm512_load_si512(&lanes.guess[s]);
+		const __mmask16 guessed= _mm512_test_epi32_mask(guess, guess);
+		const __mmask16 has_nback= _mm512_test_epi32_mask(nearest, nearest);
+		const __m512i at_guess= _mm512_and_si512(fifteen,
+			_mm512_srlv_epi32(history, _mm512_slli_epi32(guess, 2)));
+		const __mmask16 correct= guessed & _mm512_cmpeq_epi32_mask(at_guess, value);
+
+		masked_count_avx512(&lanes.correct[s], correct);
+		masked_count_avx512(&lanes.incorrect[s], guessed & has_nback & ~correct);
+		masked_count_avx512(&lanes.incorrect_no_nback[s], guessed & ~has_nback);
+		masked_count_avx512(&lanes.false_alarms[s], guessed & ~has_nback);
+		masked_count_avx512(&lanes.misses[s], has_nback & ~guessed);
+		for (int n= 1; n <= max_sim_n; ++n) {
+			const __mmask16 at_n= _mm512_cmpeq_epi32_mask(nearest, _mm512_set1_epi32(n));
+			masked_count_avx512(&lanes.opportunities[n][s], at_n);
+			masked_count_avx512(&lanes.hits[n][s], at_n & correct);
+		}
+
+		if (params.clear_on_guess) {
+			_mm512_mask_store_epi32(&lanes.history[s], guessed, _mm512_setzero_si512());
+		}
+	}
+}
+
+#pragma GCC diagnostic pop
+
+bool has_avx2() {
+	return __builtin_cpu_supports("avx2");
+}
+
+bool has_avx512() {
+	return __builtin_cpu_supports("avx512f");
+}
+#endif // NBACK_HAS_LANE_KERNELS
+
+bool has_scalar() {
+	return true;
+}
+
+// vector kernels read and write whole vectors, so counts are rounded up to
+// `width` and the columns must be padded to match
+struct sim_lane_kernel {
+	const char *name;
+	int width;
+	bool (*is_supported)();
+	void (*classify)(sim_lanes &, const sim_lane_params &, int);
+	void (*score)(sim_lanes &, const sim_lane_params &, int);
+};
+
+// best first
+const sim_lane_kernel sim_lane_kernels[]= {
+#ifdef NBACK_HAS_LANE_KERNELS
+	{ "avx512", 16, has_avx512, sim_classify_lanes_avx512, sim_score_lanes_avx512 },
+	{ "avx2", 8, has_avx2, sim_classify_lanes_avx2, sim_score_lanes_avx2 },
+#endif
+	{ "scalar", 1, has_scalar, sim_classify_lanes_scalar, sim_score_lanes_scalar }
+};
+
+// by name, or the best one this cpu runs for 0/"auto". 0 if not available
+const sim_lane_kernel *find_sim_lane_kernel(const char *name) {
+	for (size_t i= 0; i < ARRAY_SIZE(sim_lane_kernels); ++i) {
+		const sim_lane_kernel &kernel= sim_lane_kernels[i];
+		if ((name == 0 || strcmp(name, "auto") == 0 || strcmp(name, kernel.name) == 0)
+			&& kernel.is_supported()) {
+			return &kernel;
+		}
+	}
+	return 0;
+}
+
+#ifdef NBACK_UNIT_TESTS
+// every kernel this cpu runs, lane for lane against ring_t and the predicates
+void run_unit_tests_sim_lanes() {
+	enum {
+		lane_count= 64,
+		trial_count= 300
+	};
+	static sim_lanes lanes;
+	static n_back_buffer past[lane_count];
+
+	for (size_t k= 0; k < ARRAY_SIZE(sim_lane_kernels); ++k) {
+		const sim_lane_kernel &kernel= sim_lane_kernels[k];
+		if (!kernel.is_supported()) {
+			continue;
+		}
+
+		nback_rng rng(k + 1);
+		sim_lane_params params;
+		memset(&params, 0, sizeof(params));
+		for (int n= 1; n <= max_sim_n; ++n) {
+			params.hit_threshold[n]= n == 1 ? 0xffffffffu : (uint32_t)rng.next();
+		}
+		params.false_alarm_threshold= 0x40000000u;
+		params.clear_on_guess= k % 2 == 0;
+
+		lanes.clear();
+		for (int s= 0; s < lane_count; ++s) {
+			past[s].clear();
+		}
+
+		for (int trial= 0; trial < trial_count; ++trial) {
+			for (int s= 0; s < lane_count; ++s) {
+				// small alphabets early on, so n-backs at every distance show up
+				lanes.value[s]= 1 + rng.next_below(trial < 100 ? 3 : 10);
+				lanes.decision[s]= (uint32_t)rng.next();
+				lanes.false_alarm_pick[s]= 1 + rng.next_below(max_sim_n);
+				nback_push_value(past[s], lanes.value[s]);
+			}
+
+			kernel.classify(lanes, params, lane_count);
+
+			for (int s= 0; s < lane_count; ++s) {
+				const int nearest= nback_nearest_back(past[s]);
+				assert((int)lanes.nearest[s] == nearest);
+				assert((lanes.nearest[s] != 0) == nback_has_back(past[s]));
+				for (int n= 1; n <= max_sim_n; ++n) {
+					assert(packed_history_is_guess_correct(lanes.history[s], n)
+						== nback_is_guess_correct(past[s], n));
+				}
+				if (nearest) {
+					assert(lanes.guess[s] == (lanes.decision[s] < params.hit_threshold[nearest] ? (uint32_t)nearest : 0));
+				} else {
+					assert(lanes.guess[s] == (lanes.decision[s] < params.false_alarm_threshold ? lanes.false_alarm_pick[s] : 0));
+				}
+				// score arbitrary guesses too, not only the player's
+				if (trial % 3 == 0) {
+					lanes.guess[s]= rng.next_below(max_sim_n + 1);
+				}
+			}
+
+			uint32_t correct_before[lane_count];
+			memcpy(correct_before, lanes.correct, sizeof(correct_before));
+			kernel.score(lanes, params, lane_count);
+
+			for (int s= 0; s < lane_count; ++s) {
+				const int guess= lanes.guess[s];
+				const bool correct= guess && nback_is_guess_correct(past[s], guess);
+				assert(lanes.correct[s] - correct_before[s] == (uint32_t)correct);
+				if (guess && params.clear_on_guess) {
+					past[s].clear();
+					assert(lanes.history[s] == 0);
+				}
+			}
+		}
+
+		// the counters against the scalar rules, summed up
+		nback_results res;
+		memset(&res, 0, sizeof(res));
+		for (int s= 0; s < lane_count; ++s) {
+			res.correct+= lanes.correct[s];
+			res.incorrect+= lanes.incorrect[s];
+			res.incorrect_no_nback+= lanes.incorrect_no_nback[s];
+			res.misses+= lanes.misses[s];
+		}
+		assert(res.correct + res.incorrect + res.incorrect_no_nback + res.misses > 0);
+	}
+}
+#endif // NBACK_UNIT_TESTS
+
+// Up to `capacity` sessions stepped together one trial at a time, stored
+// column-wise so one trial step is a few flat loops over sessions: drawing
+// from the random streams, the classify kernel, reaction times, the score
+// kernel. Deck values are laid out by trial, then session. The random
+// streams advance exactly as in simulate_session, so a bank reproduces the
+// scalar results session for session whichever kernel runs it.
+class session_bank {
+public:
+	enum {
+		capacity= sim_lanes::capacity,
+		max_deck_trials= 64
+	};
+
+	// false if the arena had no room for a deck
+	bool load(const sim_setup &setup, uint64_t first_session, int count, session_arena &arena) {
+		assert(count > 0 && count <= capacity);
+		m_count= count;
+		m_lane_count= (count + setup.lane_kernel->width - 1)/setup.lane_kernel->width*setup.lane_kernel->width;
+		m_deck_mode= !setup.options->random_mode;
+		m_trials= setup.max_trials;
+
+		for (int s= 0; s < count; ++s) {
+			nback_rng rng(get_session_seed(setup.seed, first_session + s));
+
+			if (m_deck_mode) {
+				const size_t arena_mark= arena.get_used();
+				i_nback_value_provider *prov= create_value_provider(arena, *setup.options, rng);
+				if (!prov) {
+					return false;
+				}
+				int trials= 0;
+				for (; trials < setup.max_trials && trials < max_deck_trials && prov->has_next(); ++trials) {
+					m_deck[trials][s]= (uint8_t)prov->get_next_value();
+				}
+				arena.rewind(arena_mark);
+				// every session gets the same kind of deck
+				m_trials= trials;
+			}
+
+			m_rng[s]= rng.get_state();
+			m_virtual_usec[s]= setup.intro_usec;
+		}
+
+		// padding lanes run on zeros and are never collected
+		m_lanes.clear();
+		memset(m_slow_guesses, 0, sizeof(m_slow_guesses));
+
+		for (int n= 0; n <= max_sim_n; ++n) {
+			m_params.hit_threshold[n]= setup.hit_threshold[n];
+		}
+		for (int n= max_sim_n + 1; n < 16; ++n) {
+			m_params.hit_threshold[n]= 0;
+		}
+		m_params.false_alarm_threshold= setup.false_alarm_threshold;
+		m_params.clear_on_guess= setup.clear_on_guess;
+		return true;
+	}
+
+	void run(const sim_setup &setup) {
+		for (int trial= 0; trial < m_trials; ++trial) {
+			step(setup, trial);
+		}
+	}
+
+	void collect(sim_stats &stats) const {
+		stats.sessions+= m_count;
+		stats.trials+= (long long)m_count*m_trials;
+		for (int s= 0; s < m_count; ++s) {
+			stats.res.correct+= m_lanes.correct[s];
+			stats.res.incorrect+= m_lanes.incorrect[s];
+			stats.res.incorrect_no_nback+= m_lanes.incorrect_no_nback[s];
+			stats.res.misses+= m_lanes.misses[s];
+			stats.false_alarms+= m_lanes.false_alarms[s];
+			stats.slow_guesses+= m_slow_guesses[s];
+			stats.virtual_usec+= m_virtual_usec[s];
+		}
+		for (int n= 1; n <= max_sim_n; ++n) {
+			for (int s= 0; s < m_count; ++s) {
+				stats.opportunities[n]+= m_lanes.opportunities[n][s];
+				stats.hits[n]+= m_lanes.hits[n][s];
+			}
+		}
+	}
+
+private:
+	void step(const sim_setup &setup, int trial) {
+		for (int s= 0; s < m_count; ++s) {
+			uint64_t state= m_rng[s];
+			m_lanes.value[s]= m_deck_mode
+				? m_deck[trial][s]
+				: nback_rng::scale(nback_rng::advance(state), 10) + 1;
+			const uint64_t bits= nback_rng::advance(state);
+			m_lanes.decision[s]= (uint32_t)bits;
+			m_lanes.false_alarm_pick[s]= 1 + nback_rng::scale(bits, max_sim_n);
+			m_rng[s]= state;
+		}
+
+		setup.lane_kernel->classify(m_lanes, m_params, m_lane_count);
+
+		for (int s= 0; s < m_count; ++s) {
+			long long trial_usec= setup.timeout_usec;
+			if (m_lanes.guess[s]) {
+				const long long rt_usec= sample_reaction_usec(setup, nback_rng::advance(m_rng[s]));
+				if (rt_usec < setup.timeout_usec) {
+					trial_usec= rt_usec + setup.post_guess_usec;
+				} else {
+					m_lanes.guess[s]= 0;
+					m_slow_guesses[s]++;
+				}
+			}
+			m_virtual_usec[s]+= trial_usec;
+		}
+
+		setup.lane_kernel->score(m_lanes, m_params, m_lane_count);
+	}
+
+	int m_count;
+	int m_lane_count;
+	int m_trials;
+	bool m_deck_mode;
+	sim_lane_params m_params;
+	alignas(64) uint64_t m_rng[capacity];
+	alignas(64) uint8_t m_deck[max_deck_trials][capacity];
+	alignas(64) uint32_t m_slow_guesses[capacity];
+	alignas(64) uint64_t m_virtual_usec[capacity];
+	sim_lanes m_lanes;
+};
+
+// what one worker's arena has to hold
+inline size_t get_sim_arena_size() {
+	return sizeof(session_bank) + alignof(session_bank) + session_arena_slack;
+}
+
+void run_simulation(const sim_setup &setup, uint64_t first_session, uint64_t session_count,
+	sim_stats &stats, session_arena &arena) {
+
+	if (setup.use_bank) {
+		const size_t arena_mark= arena.get_used();
+		session_bank *bank_memory= arena.create<session_bank>();
+		if (!bank_memory) {
+			stats.out_of_memory_sessions+= session_count;
+			return;
+		}
+		session_bank &bank= *bank_memory;
+		for (uint64_t done= 0; done < session_count; ) {
+			const int count= (int)std::min<uint64_t>(session_bank::capacity, session_count - done);
+			if (!bank.load(setup, first_session + done, count, arena)) {
+				stats.out_of_memory_sessions+= session_count - done;
+				break;
+			}
+			bank.run(setup);
+			bank.collect(stats);
+			done+= count;
+		}
+		arena.rewind(arena_mark);
+		return;
+	}
+
+	for (uint64_t i= 0; i < session_count; ++i) {
+		simulate_session(setup, first_session + i, stats, arena);
+	}
+}
+
+// Spreads a simulation over worker threads. The sessions are cut into
+// chunks; every worker starts with a contiguous run of chunks in its own
+// deque, takes chunks from the back of it and, once it runs dry, steals the
+// front half of a random victim's deque. Nothing is pushed after the start,
+// so a worker that finds every deque empty is done. Each session draws from
+// its own (seed, index) stream and the counters are plain sums, so the merged
+// result is the same for any thread count.
+class sim_thread_pool {
+public:
+	sim_thread_pool(const sim_setup &setup, int thread_count)
+		: m_setup(setup), m_workers(thread_count), m_chunk_size(1), m_steals(0) {
+	}
+
+	// false if the workers' memory cannot be mapped
+	bool run(uint64_t session_count, sim_stats &out_stats) {
+		const int worker_count= (int)m_workers.size();
+		const uint64_t chunks_per_worker= 64;
+
+		for (int w= 0; w < worker_count; ++w) {
+			if (!m_workers[w].arena.open(get_sim_arena_size(), m_setup.huge_pages)) {
+				return false;
+			}
+		}
+
+		m_session_count= session_count;
+		m_chunk_size= session_count/((uint64_t)worker_count*chunks_per_worker);
+		m_chunk_size= std::max<uint64_t>(m_chunk_size, min_chunk_size);
+		m_chunk_size= std::min<uint64_t>(m_chunk_size, max_chunk_size);
+
+		const uint64_t chunk_count= (session_count + m_chunk_size - 1)/m_chunk_size;
+		for (int w= 0; w < worker_count; ++w) {
+			m_workers[w].first_chunk= chunk_count*w/worker_count;
+			m_workers[w].end_chunk= chunk_count*(w + 1)/worker_count;
+			m_workers[w].stats.clear();
+		}
+
+		std::vector<std::thread> threads;
+		for (int w= 1; w < worker_count; ++w) {
+			threads.push_back(std::thread(&sim_thread_pool::work, this, w));
+		}
+		work(0);
+		for (size_t i= 0; i < threads.size(); ++i) {
+			threads[i].join();
+		}
+
+		for (int w= 0; w < worker_count; ++w) {
+			out_stats.merge(m_workers[w].stats);
+		}
+		return true;
+	}
+
+	const char *get_arena_pages_name() const {
+		return m_workers[0].arena.get_pages_name();
+	}
+
+	long long get_steals() const {
+		return m_steals.load();
+	}
+
+	static int get_default_thread_count() {
+		const unsigned cores= std::thread::hardware_concurrency();
+		return cores == 0 ? 1 : (int)cores;
+	}
+
+private:
+	enum {
+		min_chunk_size= 64,
+		max_chunk_size= 16384
+	};
+
+	struct alignas(64) c_worker {
+		std::mutex lock;
+		// the deque: chunk indices [first_chunk, end_chunk)
+		uint64_t first_chunk;
+		uint64_t end_chunk;
+		sim_stats stats;
+		session_arena arena;
+	};
+
+	bool pop_own(c_worker &self, uint64_t &out_chunk) {
+		std::lock_guard<std::mutex> guard(self.lock);
+		if (self.first_chunk == self.end_chunk) {
+			return false;
+		}
+		out_chunk= --self.end_chunk;
+		return true;
+	}
+
+	bool steal(int thief, nback_rng &rng) {
+		const int worker_count= (int)m_workers.size();
+		const int start= (int)rng.next_below(worker_count);
+
+		for (int i= 0; i < worker_count; ++i) {
+			const int victim= (start + i) % worker_count;
+			if (victim == thief) {
+				continue;
+			}
+
+			uint64_t first, end;
+			{
+				std::lock_guard<std::mutex> guard(m_workers[victim].lock);
+				const uint64_t available= m_workers[victim].end_chunk - m_workers[victim].first_chunk;
+				if (available == 0) {
+					continue;
+				}
+				first= m_workers[victim].first_chunk;
+				end= first + (available + 1)/2;
+				m_workers[victim].first_chunk= end;
+			}
+
+			std::lock_guard<std::mutex> guard(m_workers[thief].lock);
+			m_workers[thief].first_chunk= first;
+			m_workers[thief].end_chunk= end;
+			m_steals++;
+			return true;
+		}
+
+		return false;
+	}
+
+	void work(int index) {
+		c_worker &self= m_workers[index];
+		nback_rng victim_rng(nback_rng::mix(index + 1));
+		const long long start_allocations= heap_allocation_count;
+		uint64_t chunk;
+
+		for (;;) {
+			if (!pop_own(self, chunk)) {
+				if (!steal(index, victim_rng)) {
+					break;
+				}
+				continue;
+			}
+
+			const uint64_t first= chunk*m_chunk_size;
+			const uint64_t count= std::min<uint64_t>(m_chunk_size, m_session_count - first);
+			run_simulation(m_setup, first, count, self.stats, self.arena);
+		}
+
+		self.stats.heap_allocations+= heap_allocation_count - start_allocations;
+	}
+
+	const sim_setup &m_setup;
+	std::vector<c_worker> m_workers;
+	uint64_t m_session_count;
+	uint64_t m_chunk_size;
+	std::atomic<long long> m_steals;
+};
+
+void print_sim_stats(const sim_stats &stats, long long wall_usec) {
+	const double wall_sec= wall_usec/(double)usec_per_sec;
+
+	printf("simulated %lld sessions, %lld trials in %.3f s (%.1fM trials/s)\n",
+		stats.sessions, stats.trials, wall_sec,
+		wall_sec > 0.0 ? stats.trials/wall_sec/1e6 : 0.0);
+	printf("virtual play time: %.1f h\n", stats.virtual_usec/(double)usec_per_sec/3600.0);
+	fflush(stdout);
+	print_results(STDOUT_FILENO, stats.res);
+	printf("false alarms: %lld, too slow: %lld\n", stats.false_alarms, stats.slow_guesses);
+	if (stats.out_of_memory_sessions != 0) {
+		fprintf(stderr, "%lld sessions not played, session memory exhausted\n", stats.out_of_memory_sessions);
+	}
+	printf(" n  opportunities         hits  hit rate\n");
+	for (int n= 1; n <= max_sim_n; ++n) {
+		printf("%2d  %13lld  %11lld  %8.4f\n", n, stats.opportunities[n], stats.hits[n],
+			stats.opportunities[n] ? stats.hits[n]/(double)stats.opportunities[n] : 0.0);
+	}
+}
+
+// Benchmarks
+
+// number of write syscalls this process made so far, -1 if the kernel does
+// not keep per task io accounting
+long long get_write_syscall_count() {
+	long long result= -1;
+	char line[64];
+	FILE *io= fopen("/proc/self/io", "r");
+
+	if (io) {
+		while (fgets(line, sizeof(line), io)) {
+			if (sscanf(line, "syscw: %lld", &result) == 1) {
+				break;
+			}
+		}
+		fclose(io);
+	}
+
+	return result;
+}
+
+// the stdio renderer the game used before frame_buffer, kept to compare against
+void print_n_back_buffer_stdio(const n_back_buffer &buffer) {
+	for (n_back_buffer::c_const_iterator it= buffer.iterate(); it.is_valid();) {
+		printf("%d", it.get());
+		it.next();
+		if (it.is_valid()) {
+			printf(", ");
+		}
+	}
+	puts("");
+}
+
+void print_current_value_line_stdio(int current_value, bool ping) {
+	static char pings[2]= { ' ', '*' };
+	fprintf(stdout, "\r%c%2d: ", pings[ping], current_value);
+	fflush(stdout);
+}
+
+// renders the output of 'trials' guessed trials both ways to stdout and
+// reports write syscalls and time for each on stderr
+void run_render_benchmark(int trials) {
+	n_back_history past;
+	for (int i= 1; i <= n_back_buffer::my_size; ++i) {
+		past.enqueue(i);
+	}
+
+	fflush(stdout);
+	const long long stdio_syscalls_start= get_write_syscall_count();
+	const long long stdio_start_usec= monotonic_usec();
+	for (int i= 0; i < trials; ++i) {
+		const int value= i%10 + 1;
+		print_current_value_line_stdio(value, true);
+		print_current_value_line_stdio(value, false);
+		print_n_back_buffer_stdio(past);
+		puts("correct! resuming...");
+	}
+	fflush(stdout);
+	const long long stdio_usec= monotonic_usec() - stdio_start_usec;
+	const long long stdio_syscalls= get_write_syscall_count() - stdio_syscalls_start;
+
+	const long long frame_syscalls_start= get_write_syscall_count();
+	const long long frame_start_usec= monotonic_usec();
+	for (int i= 0; i < trials; ++i) {
+		const int value= i%10 + 1;
+		print_current_value_line(value, true);
+		print_current_value_line(value, false);
+		write_guess_verdict(stdout_frame, STDOUT_FILENO, past, true, true);
+	}
+	const long long frame_usec= monotonic_usec() - frame_start_usec;
+	const long long frame_syscalls= get_write_syscall_count() - frame_syscalls_start;
+
+	fprintf(stderr, "render benchmark, %d trials, stdout is %s\n",
+		trials, isatty(STDOUT_FILENO) ? "a terminal" : "not a terminal");
+	fprintf(stderr, "  stdio: %lld write syscalls (%.2f/trial), %lld usec\n",
+		stdio_syscalls, trials ? (double)stdio_syscalls/trials : 0.0, stdio_usec);
+	fprintf(stderr, "  frame: %lld write syscalls (%.2f/trial), %lld usec\n",
+		frame_syscalls, trials ? (double)frame_syscalls/trials : 0.0, frame_usec);
+}
+
+// execs a --test session 'runs' times with stdin and stdout on a socketpair
+// and times each one from just before the fork to its first stimulus line.
+// the banner pauses count too, unless fast_start passes --fast_start on
+void run_startup_benchmark(int runs, bool fast_start) {
+	timing_stats startup;
+	int failed= 0;
+	const char *argv[]= { "nback", "--test", fast_start ? "--fast_start" : NULL, NULL };
+
+	startup.clear();
+	fflush(stdout);
+	for (int run= 0; run < runs; ++run) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+			fprintf(stderr, "Cannot create socketpair: %s\n", strerror(errno));
+			return;
+		}
+
+		const long long start_usec= monotonic_usec();
+		const pid_t child= fork();
+		if (child == 0) {
+			dup2(pair[1], STDIN_FILENO);
+			dup2(pair[1], STDOUT_FILENO);
+			execv("/proc/self/exe", (char *const *)argv);
+			_exit(127);
+		}
+		close(pair[1]);
+
+		// the stimulus line starts with "\r*"
+		bool seen= false;
+		char previous= 0;
+		char buffer[512];
+		ssize_t read_result;
+		while (!seen && child != -1 && (read_result= read(pair[0], buffer, sizeof(buffer))) > 0) {
+			for (ssize_t i= 0; i < read_result && !seen; ++i) {
+				seen= previous == '\r' && buffer[i] == '*';
+				previous= buffer[i];
+			}
+		}
+		const long long elapsed_usec= monotonic_usec() - start_usec;
+
+		close(pair[0]);
+		if (child > 0) {
+			kill(child, SIGTERM);
+			waitpid(child, NULL, 0);
+		}
+		if (seen) {
+			startup.add(elapsed_usec);
+		} else {
+			++failed;
+		}
+	}
+
+	startup.print(fast_start ? "exec to first stimulus, --fast_start" : "exec to first stimulus");
+	if (failed) {
+		printf("runs without a stimulus: %d\n", failed);
+	}
+}
+
+#ifdef NBACK_HAS_COROUTINES
+// Coroutine sessions
+//
+// A session is a coroutine that co_awaits "input or timeout" and "delay"
+// instead of blocking, so one thread can interleave any number of them. The
+// executor is a single epoll loop with one timerfd armed for the earliest
+// deadline of all suspended sessions.
+
+class coro_executor;
+
+struct coro_task {
+	struct promise_type {
+		coro_task get_return_object() {
+			return coro_task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { abort(); }
+	};
+
+	explicit coro_task(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+class coro_output;
+
+// one per watched descriptor. edge triggered: 'ready' stays set until the
+// owner drains the descriptor to EAGAIN and clears it.
+struct coro_fd_watch {
+	int fd;
+	bool ready;
+	int wait_slot;
+	// an output on the same descriptor with an unsent tail, flushed again
+	// once the descriptor is writable
+	coro_output *blocked_output;
+	bool writable_armed;
+};
+
+// What one connection sends during an executor tick. Formatted text goes
+// into the frame and constant text is referenced where it lives; both go out
+// as the iovecs of one writev when the executor flushes at the end of the
+// tick, however many times the session wrote in between. What a full socket
+// does not take stays queued, frame text included, and goes out first on the
+// next flush; the executor flushes again when the descriptor turns writable.
+// Only a client so far behind that the parts or the frame run out of room
+// loses text, and that is counted.
+class coro_output {
+private:
+	enum {
+		max_parts= 16
+	};
+
+public:
+	explicit coro_output(int fd)
+		: m_fd(fd), m_watch(0), m_part_count(0), m_run_start(0), m_write_calls(0), m_overflowed(false),
+		m_queued(false) {}
+
+	inline frame_buffer &get_frame() { return m_frame; }
+	inline int get_fd() const { return m_fd; }
+	inline long long get_write_calls() const { return m_write_calls; }
+	inline bool has_pending() const { return m_part_count != 0 || m_frame.get_length() > m_run_start; }
+	// text was dropped because the descriptor fell too far behind
+	inline bool has_overflowed() const { return m_overflowed || m_frame.is_truncated(); }
+
+	// the watch of this descriptor, so a blocked flush can wait for EPOLLOUT
+	inline void set_watch(coro_fd_watch *watch) { m_watch= watch; }
+
+	// text that stays put until the flush
+	void append_static(const char *text, int len) {
+		// one part is kept for the frame's last run
+		if (m_part_count + 3 > max_parts) {
+			flush();
+		}
+		if (m_part_count + 3 > max_parts) {
+			m_overflowed= true;
+			return;
+		}
+		close_run();
+		m_parts[m_part_count].iov_base= (void *)text;
+		m_parts[m_part_count].iov_len= len;
+		++m_part_count;
+	}
+
+	// false if the descriptor would not take it all (see has_pending) or
+	// failed
+	bool flush() {
+		bool result= true;
+		iovec *part= m_parts;
+
+		close_run();
+		int part_count= m_part_count;
+		while (part_count > 0) {
+			ssize_t written= writev(m_fd, part, part_count);
+			++m_write_calls;
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					// the peer is gone, nothing left is deliverable
+					part_count= 0;
+				}
+				result= false;
+				break;
+			}
+
+			while (part_count > 0 && (size_t)written >= part->iov_len) {
+				written-= part->iov_len;
+				++part;
+				--part_count;
+			}
+			if (part_count > 0) {
+				part->iov_base= (char *)part->iov_base + written;
+				part->iov_len-= written;
+			}
+		}
+
+		if (part_count > 0) {
+			memmove(m_parts, part, part_count*sizeof(iovec));
+			m_part_count= part_count;
+		} else {
+			m_part_count= 0;
+			m_run_start= 0;
+			m_overflowed= m_overflowed || m_frame.is_truncated();
+			m_frame.clear();
+		}
+		return result;
+	}
+
+private:
+	friend class coro_executor;
+
+	// the frame text since the last static part becomes a part of its own
+	void close_run() {
+		const int len= m_frame.get_length();
+		if (len > m_run_start) {
+			if (m_part_count == max_parts) {
+				m_overflowed= true;
+			} else {
+				m_parts[m_part_count].iov_base= (void *)(m_frame.get_data() + m_run_start);
+				m_parts[m_part_count].iov_len= len - m_run_start;
+				++m_part_count;
+			}
+			m_run_start= len;
+		}
+	}
+
+	int m_fd;
+	coro_fd_watch *m_watch;
+	frame_buffer m_frame;
+	iovec m_parts[max_parts];
+	int m_part_count;
+	int m_run_start;
+	long long m_write_calls;
+	bool m_overflowed;
+	// on the executor's flush list
+	bool m_queued;
+};
+
+class coro_executor {
+private:
+	enum {
+		max_events= 256
+	};
+
+	// a suspended coroutine. slots are recycled; seq tells stale timers apart.
+	struct c_wait_slot {
+		std::coroutine_handle<> handle;
+		unsigned seq;
+		bool *out_timed_out;
+		coro_fd_watch *watch;
+		bool in_use;
+	};
+
+	struct c_timer {
+		long long deadline_usec;
+		int slot;
+		unsigned seq;
+
+		bool operator<(const c_timer &other) const {
+			// std heaps are max-heaps
+			return deadline_usec > other.deadline_usec;
+		}
+	};
+
+public:
+	coro_executor()
+		: m_epoll_fd(-1), m_timer_fd(-1), m_armed_usec(-1), m_live_tasks(0), m_stopping(false), m_syscalls(0) {}
+
+	~coro_executor() {
+		if (m_timer_fd != -1) {
+			close(m_timer_fd);
+		}
+		if (m_epoll_fd != -1) {
+			close(m_epoll_fd);
+		}
+	}
+
+	bool open() {
+		m_epoll_fd= epoll_create1(EPOLL_CLOEXEC);
+		m_timer_fd= timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (m_epoll_fd == -1 || m_timer_fd == -1) {
+			return false;
+		}
+
+		epoll_event ev;
+		ev.events= EPOLLIN;
+		ev.data.ptr= NULL;
+		m_syscalls+= 3;
+		return epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_timer_fd, &ev) == 0;
+	}
+
+	bool watch(coro_fd_watch &fd_watch, int fd) {
+		fd_watch.fd= fd;
+		fd_watch.ready= false;
+		fd_watch.wait_slot= -1;
+		fd_watch.blocked_output= NULL;
+		fd_watch.writable_armed= false;
+
+		epoll_event ev;
+		ev.events= EPOLLIN | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr= &fd_watch;
+		++m_syscalls;
+		return epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+	}
+
+	void unwatch(coro_fd_watch &fd_watch) {
+		++m_syscalls;
+		epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd_watch.fd, NULL);
+		fd_watch.fd= -1;
+		fd_watch.blocked_output= NULL;
+	}
+
+	// sent with everything else written this tick, once the ready
+	// coroutines have run
+	void queue_output(coro_output &output) {
+		if (!output.m_queued) {
+			output.m_queued= true;
+			m_outputs.push_back(&output);
+		}
+	}
+
+	// sends an output right away, for one that is about to go away
+	void flush_output(coro_output &output) {
+		if (output.m_queued) {
+			m_outputs.erase(std::find(m_outputs.begin(), m_outputs.end(), &output));
+			output.m_queued= false;
+		}
+		output.flush();
+	}
+
+	// epoll, timerfd and the like, for benchmarks
+	inline long long get_syscalls() const { return m_syscalls; }
+
+	// takes ownership of the task and starts it on the next tick
+	void spawn(coro_task task) {
+		++m_live_tasks;
+		m_run_queue.push_back(task.m_handle);
+	}
+
+	inline bool is_stopping() const { return m_stopping; }
+	inline int get_live_tasks() const { return m_live_tasks; }
+
+	// wakes every suspended coroutine; they see is_stopping() and return
+	void request_stop() {
+		m_stopping= true;
+		for (int i= 0; i < (int)m_slots.size(); ++i) {
+			if (m_slots[i].in_use) {
+				wake(i, true);
+			}
+		}
+	}
+
+	// runs until every spawned task has returned
+	void run() {
+		epoll_event events[max_events];
+
+		while (true) {
+			run_ready();
+			flush_outputs();
+			if (m_live_tasks == 0) {
+				break;
+			}
+
+			arm_timer();
+			const int event_count= epoll_wait(m_epoll_fd, events, max_events, -1);
+			++m_syscalls;
+			if (event_count == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				fprintf(stderr, "Error in epoll_wait: %s\n", strerror(errno));
+				abort();
+			}
+
+			for (int i= 0; i < event_count; ++i) {
+				coro_fd_watch *fd_watch= static_cast<coro_fd_watch*>(events[i].data.ptr);
+				if (fd_watch == NULL) {
+					unsigned long long expirations;
+					while (++m_syscalls, read(m_timer_fd, &expirations, sizeof(expirations)) > 0) {
+					}
+					m_armed_usec= -1;
+				} else if (fd_watch->fd != -1) {
+					if ((events[i].events & EPOLLOUT) && fd_watch->blocked_output) {
+						queue_output(*fd_watch->blocked_output);
+						fd_watch->blocked_output= NULL;
+					}
+					if (events[i].events & ~EPOLLOUT) {
+						fd_watch->ready= true;
+						if (fd_watch->wait_slot != -1) {
+							wake(fd_watch->wait_slot, false);
+						}
+					}
+				}
+			}
+
+			expire_timers(monotonic_usec());
+		}
+	}
+
+	// awaitables
+
+	struct c_readable_awaiter {
+		coro_executor *executor;
+		coro_fd_watch *fd_watch;
+		long long deadline_usec;
+		bool timed_out;
+
+		bool await_ready() const { return fd_watch->ready || executor->is_stopping(); }
+		void await_suspend(std::coroutine_handle<> handle) {
+			executor->park(handle, fd_watch, deadline_usec, &timed_out);
+		}
+		// true: the descriptor has something to read
+		bool await_resume() const { return fd_watch->ready && !executor->is_stopping(); }
+	};
+
+	struct c_delay_awaiter {
+		coro_executor *executor;
+		long long deadline_usec;
+		bool timed_out;
+
+		bool await_ready() const {
+			return executor->is_stopping() || deadline_usec <= monotonic_usec();
+		}
+		void await_suspend(std::coroutine_handle<> handle) {
+			executor->park(handle, NULL, deadline_usec, &timed_out);
+		}
+		void await_resume() const {}
+	};
+
+	// deadline -1 waits for input only
+	c_readable_awaiter input_or_timeout(coro_fd_watch &fd_watch, long long deadline_usec) {
+		c_readable_awaiter result= { this, &fd_watch, deadline_usec, false };
+		return result;
+	}
+
+	c_delay_awaiter delay_until(long long deadline_usec) {
+		c_delay_awaiter result= { this, deadline_usec, false };
+		return result;
+	}
+
+	c_delay_awaiter delay(long long usec) {
+		return delay_until(monotonic_usec() + usec);
+	}
+
+private:
+	void park(std::coroutine_handle<> handle, coro_fd_watch *fd_watch, long long deadline_usec, bool *out_timed_out) {
+		int slot;
+		if (!m_free_slots.empty()) {
+			slot= m_free_slots.back();
+			m_free_slots.pop_back();
+		} else {
+			slot= (int)m_slots.size();
+			c_wait_slot empty_slot= { std::coroutine_handle<>(), 0, NULL, NULL, false };
+			m_slots.push_back(empty_slot);
+		}
+
+		c_wait_slot &wait= m_slots[slot];
+		wait.handle= handle;
+		wait.out_timed_out= out_timed_out;
+		wait.watch= fd_watch;
+		wait.in_use= true;
+		if (fd_watch) {
+			fd_watch->wait_slot= slot;
+		}
+
+		if (deadline_usec >= 0) {
+			const c_timer timer= { deadline_usec, slot, wait.seq };
+			m_timers.push_back(timer);
+			std::push_heap(m_timers.begin(), m_timers.end());
+		}
+	}
+
+	void wake(int slot, bool timed_out) {
+		c_wait_slot &wait= m_slots[slot];
+		assert(wait.in_use);
+
+		if (wait.watch) {
+			wait.watch->wait_slot= -1;
+		}
+		*wait.out_timed_out= timed_out;
+		m_run_queue.push_back(wait.handle);
+
+		++wait.seq;
+		wait.in_use= false;
+		wait.watch= NULL;
+		m_free_slots.push_back(slot);
+	}
+
+	void expire_timers(long long now_usec) {
+		while (!m_timers.empty() && m_timers.front().deadline_usec <= now_usec) {
+			const c_timer timer= m_timers.front();
+			std::pop_heap(m_timers.begin(), m_timers.end());
+			m_timers.pop_back();
+
+			if (m_slots[timer.slot].in_use && m_slots[timer.slot].seq == timer.seq) {
+				wake(timer.slot, true);
+			}
+		}
+	}
+
+	void arm_timer() {
+		expire_timers(monotonic_usec());
+		// drop cancelled timers so they do not cause spurious wakeups
+		while (!m_timers.empty()
+			&& (!m_slots[m_timers.front().slot].in_use
+				|| m_slots[m_timers.front().slot].seq != m_timers.front().seq)) {
+			std::pop_heap(m_timers.begin(), m_timers.end());
+			m_timers.pop_back();
+		}
+
+		const long long next_usec= m_timers.empty() ? -1 : m_timers.front().deadline_usec;
+		if (next_usec != m_armed_usec) {
+			itimerspec spec;
+			memset(&spec, 0, sizeof(spec));
+			if (next_usec != -1) {
+				spec.it_value.tv_sec= next_usec/usec_per_sec;
+				spec.it_value.tv_nsec= (next_usec%usec_per_sec)*nsec_per_usec;
+			}
+			timerfd_settime(m_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+			++m_syscalls;
+			m_armed_usec= next_usec;
+		}
+	}
+
+	// finished frames are destroyed only here, after the epoll batch that
+	// may still reference their watches has been handled
+	void run_ready() {
+		while (!m_run_queue.empty()) {
+			m_running.swap(m_run_queue);
+			for (int i= 0; i < (int)m_running.size(); ++i) {
+				m_running[i].resume();
+				if (m_running[i].done()) {
+					m_running[i].destroy();
+					--m_live_tasks;
+				}
+			}
+			m_running.clear();
+		}
+	}
+
+	void flush_outputs() {
+		for (size_t i= 0; i < m_outputs.size(); ++i) {
+			m_outputs[i]->m_queued= false;
+			if (!m_outputs[i]->flush() && m_outputs[i]->has_pending()) {
+				wait_writable(*m_outputs[i]);
+			}
+		}
+		m_outputs.clear();
+	}
+
+	// EPOLLOUT is added to the watch the first time its output blocks and
+	// stays: edge triggered, it only fires when a full descriptor drains
+	void wait_writable(coro_output &output) {
+		coro_fd_watch *fd_watch= output.m_watch;
+		if (!fd_watch || fd_watch->fd == -1) {
+			return;
+		}
+
+		fd_watch->blocked_output= &output;
+		if (!fd_watch->writable_armed) {
+			epoll_event ev;
+			ev.events= EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			ev.data.ptr= fd_watch;
+			++m_syscalls;
+			fd_watch->writable_armed= epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd_watch->fd, &ev) == 0;
+		}
+	}
+
+	int m_epoll_fd;
+	int m_timer_fd;
+	long long m_armed_usec;
+	int m_live_tasks;
+	bool m_stopping;
+	std::vector<c_wait_slot> m_slots;
+	std::vector<int> m_free_slots;
+	std::vector<c_timer> m_timers;
+	std::vector<std::coroutine_handle<> > m_run_queue;
+	std::vector<std::coroutine_handle<> > m_running;
+	std::vector<coro_output*> m_outputs;
+	long long m_syscalls;
+};
+
+// everything one session owns. the value provider lives in the session's own
+// factory slab, so sessions share nothing.
+struct coro_session {
+	const nback_options *options;
+	value_provider_factory provider_factory;
+	i_nback_value_provider *prov;
+	// the stream decks are shuffled from, game_rng unless a shard has its own
+	nback_rng *rng;
+	n_back_history past;
+	nback_results res;
+	int trials;
+	nback_timing timing;
+	guess_reader input;
+	coro_output output;
+	coro_fd_watch watch;
+	// the interactive session takes its helpers (signal watcher) down with it
+	bool stop_executor_on_end;
+	// a socket session is over when its client hangs up
+	bool end_on_eof;
+	bool hung_up;
+	event_log *log;
+	// the connection's number on a logging server, for its trial records
+	int id;
+	// called last, once the session is over. the server closes and frees its
+	// connections here
+	void (*on_end)(coro_session &session, void *context);
+	void *on_end_context;
+
+	coro_session(const nback_options *session_options, int in_fd, int session_out_fd)
+		: options(session_options), prov(0), rng(&game_rng), input(in_fd), output(session_out_fd),
+		stop_executor_on_end(false), end_on_eof(false), hung_up(false), log(0), id(0),
+		on_end(0), on_end_context(0) {
+		res= nback_results();
+		trials= 0;
+		timing.clear();
+		watch.fd= -1;
+		watch.ready= false;
+		watch.wait_slot= -1;
+		watch.blocked_output= NULL;
+		watch.writable_armed= false;
+	}
+};
+
+const long long output_drain_poll_usec= 10 * usec_per_msec;
+
+// same game as main's loop, one co_await wherever main would block
+coro_task run_session_coro(coro_executor &executor, coro_session &session) {
+	const nback_options &options= *session.options;
+	const long long timeout_usec= (long long)get_guess_timeout_sec(options.timeout_sec)*usec_per_sec;
+
+	session.prov= create_value_provider(session.provider_factory, options, *session.rng);
+	executor.watch(session.watch, session.input.get_fd());
+	if (session.output.get_fd() == session.input.get_fd()) {
+		session.output.set_watch(&session.watch);
+	}
+
+	coro_output &output= session.output;
+	frame_buffer &frame= output.get_frame();
+	char max_line[64];
+
+	for (int i= 0; i < (int)ARRAY_SIZE(banner_lines); ++i) {
+		output.append_static(banner_lines[i], (int)strlen(banner_lines[i]));
+		output.append_static("\n", 1);
+	}
+	frame.append(max_line, snprintf(max_line, sizeof(max_line), banner_max_format, n_back_buffer::my_size-1));
+	executor.queue_output(output);
+	if (!options.fast_start) {
+		co_await executor.delay(usec_per_sec);
+	}
+	frame.append("Here we go!\n");
+	executor.queue_output(output);
+	if (!options.fast_start) {
+		co_await executor.delay(usec_per_sec);
+	}
+
+	const long long start_usec= monotonic_usec();
+	int trial= 0;
+
+	while (!executor.is_stopping() && session.prov->has_next()) {
+		optional<int> guess_back= { false, 0 };
+		long long guess_usec;
+
+		session.timing.begin_trial();
+		const int current_value= session.prov->get_next_value();
+		const uint64_t matches= nback_push_value_matches(session.past, current_value);
+		const bool has_nback= matches != 0;
+
+		// edge triggered: without a readiness event nothing new came in. all
+		// of it goes, what stayed queued would count against this stimulus
+		while (session.watch.ready) {
+			session.watch.ready= session.input.drain_once();
+		}
+		session.input.discard_buffered();
+		render_current_value_line(frame, current_value, true);
+		executor.queue_output(output);
+		session.timing.mark_onset();
+
+		const long long ping_deadline_usec= session.timing.onset_usec + time_to_show_ping_usec;
+		const long long deadline_usec= session.timing.onset_usec + timeout_usec;
+		bool ping_shown= true;
+
+		while (!guess_back.is_set && !executor.is_stopping() && monotonic_usec() < deadline_usec) {
+			const long long wake_usec= ping_shown ? ping_deadline_usec : deadline_usec;
+
+			if (session.input.is_eof() && session.end_on_eof) {
+				session.hung_up= true;
+				break;
+			} else if (session.input.is_eof()) {
+				co_await executor.delay_until(wake_usec);
+			} else if (co_await executor.input_or_timeout(session.watch, wake_usec)) {
+				session.watch.ready= session.input.drain_once();
+				guess_back.is_set= session.input.pop_guess(session.timing.onset_usec, guess_back.value, guess_usec);
+				if (guess_back.is_set) {
+					session.timing.mark_input(guess_usec);
+				}
+			}
+
+			if (ping_shown && monotonic_usec() >= ping_deadline_usec) {
+				render_current_value_line(frame, current_value, false);
+				executor.queue_output(output);
+				ping_shown= false;
+			}
+		}
+
+		if (executor.is_stopping() || session.hung_up) {
+			break;
+		}
+
+		const bool correct= nback_score_trial(session.res, matches, guess_back);
+
+		if (session.log) {
+			trial_record record;
+			fill_trial_record(record, session.id, trial, session.past, has_nback, guess_back, correct);
+			fill_trial_record_timing(record, session.timing, start_usec);
+			session.log->push(record);
+		}
+		++trial;
+
+		if (guess_back.is_set) {
+			if (options.print_buffer_on_guess) {
+				render_n_back_buffer(frame, session.past);
+			}
+			render_verdict(frame, correct);
+			executor.queue_output(output);
+
+			if (options.clear_buffer_on_guess) {
+				session.past.clear();
+			}
+			co_await executor.delay(2*usec_per_sec);
+		}
+	}
+
+	session.trials= trial;
+	if (!session.hung_up) {
+		if (executor.is_stopping()) {
+			frame.append("\n... Stopped early.\n");
+		} else {
+			frame.append("... That's all!\n");
+		}
+		render_results(frame, session.res);
+
+		// a client that is behind still gets its summary, within one timeout
+		const long long drain_deadline_usec= monotonic_usec() + timeout_usec;
+		executor.flush_output(output);
+		while (output.has_pending() && !executor.is_stopping() && monotonic_usec() < drain_deadline_usec) {
+			executor.queue_output(output);
+			co_await executor.delay(output_drain_poll_usec);
+		}
+	}
+	// the session may be gone once it has ended
+	executor.flush_output(output);
+
+	executor.unwatch(session.watch);
+	if (session.stop_executor_on_end) {
+		executor.request_stop();
+	}
+	if (session.on_end) {
+		session.on_end(session, session.on_end_context);
+	}
+}
+
+coro_task watch_signals_coro(coro_executor &executor, session_signals &signals) {
+	coro_fd_watch watch;
+	executor.watch(watch, signals.get_fd());
+
+	while (!executor.is_stopping()) {
+		co_await executor.input_or_timeout(watch, -1);
+		watch.ready= false;
+		if (signals.process() & session_signals::event_shutdown) {
+			executor.request_stop();
+		}
+	}
+
+	executor.unwatch(watch);
+}
+
+// Session server
+//
+// --serve path: every connection to a Unix domain socket plays a session of
+// its own. Each one is the run_session_coro of --coro on the socket, so all
+// of them share one epoll loop and one timerfd; a waiting session costs a
+// heap entry and a wait slot, not a thread. A client that hangs up ends its
+// session.
+
+struct session_server_stats {
+	long long accepted;
+	long long finished;
+	long long trials;
+	int active;
+	nback_results res;
+	// syscalls: the sessions' reads and writes, the event loops' own
+	long long reads;
+	long long writes;
+	long long loop_syscalls;
+	// sessions whose client read too slowly to get all of their output
+	long long lost_output;
+};
+
+class session_shard;
+
+struct session_server {
+	const nback_options *options;
+	int listen_fd;
+	coro_fd_watch watch;
+	event_log *log;
+	session_server_stats stats;
+	// with --shards, accepted connections are dealt out to these in turn
+	session_shard *shards;
+	int shard_count;
+	int next_shard;
+	long long rejected;
+};
+
+void add_session_to_stats(session_server_stats &stats, const coro_session &session) {
+	stats.res.correct+= session.res.correct;
+	stats.res.incorrect+= session.res.incorrect;
+	stats.res.incorrect_no_nback+= session.res.incorrect_no_nback;
+	stats.res.misses+= session.res.misses;
+	stats.trials+= session.trials;
+	stats.reads+= session.input.get_read_calls();
+	stats.writes+= session.output.get_write_calls();
+	if (session.output.has_overflowed() || session.output.has_pending()) {
+		stats.lost_output++;
+	}
+	stats.finished++;
+	stats.active--;
+}
+
+void merge_server_stats(session_server_stats &stats, const session_server_stats &other) {
+	stats.res.correct+= other.res.correct;
+	stats.res.incorrect+= other.res.incorrect;
+	stats.res.incorrect_no_nback+= other.res.incorrect_no_nback;
+	stats.res.misses+= other.res.misses;
+	stats.accepted+= other.accepted;
+	stats.finished+= other.finished;
+	stats.trials+= other.trials;
+	stats.active+= other.active;
+	stats.reads+= other.reads;
+	stats.writes+= other.writes;
+	stats.loop_syscalls+= other.loop_syscalls;
+	stats.lost_output+= other.lost_output;
+}
+
+void end_server_session(coro_session &session, void *context) {
+	const int fd= session.input.get_fd();
+
+	add_session_to_stats(*static_cast<session_server_stats*>(context), session);
+
+	delete &session;
+	close(fd);
+}
+
+// Sharded server
+//
+// --shards n: n executors instead of one, each on its own thread pinned to
+// a core. The main thread only accepts, and deals the connections out in
+// turn through each shard's inbox, a single producer ring woken by an
+// eventfd. From then on a session never leaves its shard: the session
+// objects (and the provider slabs in them), the random stream and the stats
+// are all shard-local, so the per-trial path shares nothing and takes no
+// locks. The shards' stats are merged once they have stopped.
+
+class session_shard {
+private:
+	enum {
+		// power of two
+		inbox_capacity= 1024
+	};
+
+public:
+	session_shard()
+		: m_options(0), m_index(0), m_event_fd(-1), m_head(0), m_tail(0), m_stop(false) {
+		memset(&m_stats, 0, sizeof(m_stats));
+	}
+
+	~session_shard() {
+		for (size_t i= 0; i < m_free_sessions.size(); ++i) {
+			::operator delete(m_free_sessions[i]);
+		}
+		if (m_event_fd != -1) {
+			close(m_event_fd);
+		}
+	}
+
+	bool open(const nback_options *options, int index) {
+		m_options= options;
+		m_index= index;
+		m_rng.reseed(time(0) ^ nback_rng::mix(index));
+		m_event_fd= eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		return m_event_fd != -1 && m_executor.open();
+	}
+
+	void start() {
+		m_thread= std::thread(&session_shard::thread_main, this);
+	}
+
+	// acceptor thread only. false when the inbox is full
+	bool post(int fd) {
+		const unsigned head= m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) >= inbox_capacity) {
+			return false;
+		}
+		m_inbox[head & (inbox_capacity - 1)]= fd;
+		m_head.store(head + 1, std::memory_order_release);
+		wake();
+		return true;
+	}
+
+	// ends every session of the shard, as SIGINT does for a single loop
+	void stop() {
+		m_stop.store(true);
+		wake();
+	}
+
+	void join() {
+		if (m_thread.joinable()) {
+			m_thread.join();
+		}
+	}
+
+	// once joined
+	inline const session_server_stats &get_stats() const { return m_stats; }
+
+private:
+	void wake() {
+		const uint64_t one= 1;
+		if (write(m_event_fd, &one, sizeof(one)) == -1) {
+			// the counter is saturated, so the shard is awake already
+		}
+	}
+
+	void thread_main() {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(m_index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+		// best effort: an unpinned shard still works
+		sched_setaffinity(0, sizeof(cpus), &cpus);
+
+		m_executor.spawn(run_inbox_coro());
+		m_executor.run();
+		m_stats.loop_syscalls+= m_executor.get_syscalls();
+	}
+
+	coro_task run_inbox_coro() {
+		m_executor.watch(m_watch, m_event_fd);
+
+		while (!m_executor.is_stopping()) {
+			co_await m_executor.input_or_timeout(m_watch, -1);
+			m_watch.ready= false;
+
+			uint64_t count;
+			while (++m_stats.loop_syscalls, read(m_event_fd, &count, sizeof(count)) > 0) {
+			}
+
+			const unsigned head= m_head.load(std::memory_order_acquire);
+			unsigned tail= m_tail.load(std::memory_order_relaxed);
+			for (; tail != head; ++tail) {
+				start_session(m_inbox[tail & (inbox_capacity - 1)]);
+			}
+			m_tail.store(tail, std::memory_order_release);
+
+			if (m_stop.load()) {
+				m_executor.request_stop();
+			}
+		}
+
+		m_executor.unwatch(m_watch);
+	}
+
+	void start_session(int fd) {
+		void *storage;
+		if (!m_free_sessions.empty()) {
+			storage= m_free_sessions.back();
+			m_free_sessions.pop_back();
+		} else {
+			storage= ::operator new(sizeof(coro_session));
+		}
+
+		coro_session *session= new(storage) coro_session(m_options, fd, fd);
+		session->rng= &m_rng;
+		session->end_on_eof= true;
+		session->on_end= end_session;
+		session->on_end_context= this;
+		m_stats.accepted++;
+		m_stats.active++;
+		m_executor.spawn(run_session_coro(m_executor, *session));
+	}
+
+	static void end_session(coro_session &session, void *context) {
+		session_shard &shard= *static_cast<session_shard*>(context);
+		const int fd= session.input.get_fd();
+
+		add_session_to_stats(shard.m_stats, session);
+		session.~coro_session();
+		shard.m_free_sessions.push_back(&session);
+		close(fd);
+	}
+
+	const nback_options *m_options;
+	int m_index;
+	int m_event_fd;
+	coro_fd_watch m_watch;
+	coro_executor m_executor;
+	nback_rng m_rng;
+	session_server_stats m_stats;
+	std::vector<void*> m_free_sessions;
+	std::thread m_thread;
+	alignas(64) std::atomic<unsigned> m_head;
+	alignas(64) std::atomic<unsigned> m_tail;
+	std::atomic<bool> m_stop;
+	int m_inbox[inbox_capacity];
+};
+
+coro_task accept_sessions_coro(coro_executor &executor, session_server &server) {
+	executor.watch(server.watch, server.listen_fd);
+
+	while (!executor.is_stopping()) {
+		if (!co_await executor.input_or_timeout(server.watch, -1)) {
+			continue;
+		}
+		server.watch.ready= false;
+
+		for (;;) {
+			const int fd= accept4(server.listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			server.stats.loop_syscalls++;
+			if (fd == -1) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					fprintf(stderr, "Error in accept: %s\n", strerror(errno));
+				}
+				break;
+			}
+
+			if (server.shard_count > 0) {
+				session_shard &shard= server.shards[server.next_shard];
+				server.next_shard= (server.next_shard + 1) % server.shard_count;
+				// the eventfd write
+				server.stats.loop_syscalls++;
+				if (!shard.post(fd)) {
+					server.rejected++;
+					close(fd);
+				}
+				continue;
+			}
 
-	bool result= false;
-	fd_set read_fds;
-	int select_result;
-	char buff[255]= {0};
-	int read_len;
+			coro_session *session= new coro_session(server.options, fd, fd);
+			server.stats.accepted++;
+			session->id= (int)server.stats.accepted;
+			session->end_on_eof= true;
+			session->log= server.log;
+			session->on_end= end_server_session;
+			session->on_end_context= &server.stats;
+			server.stats.active++;
+			executor.spawn(run_session_coro(executor, *session));
+		}
+	}
 
-	const int per_select_timeout_usec= 50 * usec_per_msec;
-	const int time_to_show_ping_usec= 150 * usec_per_msec;
-	const int iterations_to_show_ping= time_to_show_ping_usec/per_select_timeout_usec;
-	const int default_guess_timeout_sec= 2;
+	executor.unwatch(server.watch);
+}
 
-	const int total_timeout_seconds= opt_guess_timeout_sec.is_set
-		? opt_guess_timeout_sec.value
-		: default_guess_timeout_sec;
-	const int iterations_before_give_up=
-		total_timeout_seconds*usec_per_sec/per_select_timeout_usec;
+void print_server_stats(const session_server_stats &stats, long long rejected) {
+	printf("sessions: %lld accepted, %lld finished, %lld trials\n", stats.accepted, stats.finished, stats.trials);
+	if (rejected) {
+		printf("sessions turned away (shard inbox full): %lld\n", rejected);
+	}
+	if (stats.lost_output) {
+		printf("sessions whose client fell too far behind to get all output: %lld\n", stats.lost_output);
+	}
+
+	const long long syscalls= stats.reads + stats.writes + stats.loop_syscalls;
+	printf("syscalls: %lld, %.2f per trial (reads %lld, writes %lld, event loop %lld)\n",
+		syscalls, stats.trials ? syscalls/(double)stats.trials : 0.0,
+		stats.reads, stats.writes, stats.loop_syscalls);
+	fflush(stdout);
+	print_results(STDOUT_FILENO, stats.res);
+}
 
-	for (int cnt= 0; !result && cnt < iterations_before_give_up; ++cnt) {
+// runs until SIGINT/SIGTERM. 0 on a clean shutdown
+int run_session_server(const nback_options &options, const char *path, event_log *log) {
+	coro_executor executor;
+	session_signals signals;
+	session_server server;
 
-		timeval tv;
-		tv.tv_sec= 0;
-		tv.tv_usec= per_select_timeout_usec;
+	memset(&server.stats, 0, sizeof(server.stats));
+	server.options= &options;
+	server.log= log;
+	server.shards= 0;
+	server.shard_count= options.server_shards;
+	server.next_shard= 0;
+	server.rejected= 0;
 
-		FD_ZERO(&read_fds);
-		FD_SET(STDIN_FILENO, &read_fds);
+	// a client that went away must not take the server with it
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit();
 
-		if (cnt==0 || cnt==iterations_to_show_ping) {
-			print_current_value_line(current_value, cnt < iterations_to_show_ping);
+	server.listen_fd= open_server_socket(path);
+	if (server.listen_fd == -1) {
+		fprintf(stderr, "Cannot listen on '%s': %s\n", path, strerror(errno));
+		return 1;
+	}
+	if (!executor.open()) {
+		fprintf(stderr, "Cannot create event loop: %s\n", strerror(errno));
+		close(server.listen_fd);
+		return 1;
+	}
+	// before any shard thread exists, so that they inherit the blocked signals
+	if (signals.open()) {
+		executor.spawn(watch_signals_coro(executor, signals));
+	}
+
+	std::unique_ptr<session_shard[]> shards;
+	if (server.shard_count > 0) {
+		if (log) {
+			fputs("--log records one session loop, ignored with --shards\n", stderr);
+			server.log= NULL;
+		}
+		shards.reset(new session_shard[server.shard_count]);
+		server.shards= shards.get();
+		for (int i= 0; i < server.shard_count; ++i) {
+			if (!shards[i].open(&options, i)) {
+				fprintf(stderr, "Cannot create shard event loop: %s\n", strerror(errno));
+				close(server.listen_fd);
+				return 1;
+			}
 		}
+		for (int i= 0; i < server.shard_count; ++i) {
+			shards[i].start();
+		}
+	}
+
+	printf("serving on %s", path);
+	if (server.shard_count > 0) {
+		printf(" with %d shards", server.shard_count);
+	}
+	printf("\n");
+	fflush(stdout);
 
-		select_result= select(1, &read_fds, NULL, NULL, &tv);
+	executor.spawn(accept_sessions_coro(executor, server));
+	executor.run();
+	server.stats.loop_syscalls+= executor.get_syscalls();
 
-		if (select_result == -1) {
-			if (errno != EINTR) {
-				fprintf(stderr, "Error in select. todo: stringify\n");
-			} else {
-				//we've received an interrupt - handle this
-				fprintf(stderr, "todo: interrupt?\n");
+	close(server.listen_fd);
+	unlink(path);
+	for (int i= 0; i < server.shard_count; ++i) {
+		shards[i].stop();
+	}
+	for (int i= 0; i < server.shard_count; ++i) {
+		shards[i].join();
+		merge_server_stats(server.stats, shards[i].get_stats());
+	}
+	signals.close();
+	print_server_stats(server.stats, server.rejected);
+	return 0;
+}
+
+// Load generator
+//
+// --load n: n virtual trainees play at once, each against a copy of this
+// binary on a pseudo-terminal or, with --load_socket, against a --serve
+// server. A trainee only sees the byte stream: it picks the stimuli out of
+// it, keeps its own history with the game's predicates and answers like a
+// --simulate player, on its own (seed, index) stream. All of them share one
+// coro_executor. Onset lateness is how late a stimulus arrived against when
+// it was due: a timeout after the previous one, or the pause after a verdict.
+
+struct load_stats {
+	int running;
+	long long stimuli;
+	long long guesses;
+	long long failed;
+	timing_stats onset_lateness;
+	// guess written to verdict read, usec
+	std::vector<long long> verdict_latency;
+
+	void clear() {
+		running= 0;
+		stimuli= 0;
+		guesses= 0;
+		failed= 0;
+		onset_lateness.clear();
+		verdict_latency.clear();
+	}
+};
+
+struct load_trainee {
+	enum {
+		parse_text,
+		parse_return,
+		parse_value
+	};
+
+	int fd;
+	pid_t child;
+	coro_fd_watch watch;
+	nback_rng rng;
+	n_back_buffer past;
+	int parse_state;
+	int value;
+	int value_digits;
+	// -1 while nothing is due, pending or awaiting a verdict
+	long long due_usec;
+	long long send_usec;
+	long long sent_usec;
+	int guess;
+	bool done;
+};
+
+void load_on_stimulus(load_trainee &trainee, const sim_setup &setup, long long now_usec, load_stats &stats) {
+	stats.stimuli++;
+	if (trainee.due_usec >= 0) {
+		stats.onset_lateness.add(now_usec - trainee.due_usec);
+	}
+	trainee.due_usec= now_usec + setup.timeout_usec;
+	// a guess that missed its stimulus gets no verdict
+	trainee.sent_usec= -1;
+	trainee.send_usec= -1;
+
+	const uint64_t matches= nback_push_value_matches(trainee.past, trainee.value);
+	const bool has_nback= matches != 0;
+	const int nearest= nback_mask_nearest_back(matches);
+	const uint64_t bits= trainee.rng.next();
+	const uint32_t decision= (uint32_t)bits;
+
+	trainee.guess= 0;
+	if (has_nback && decision < setup.hit_threshold[nearest]) {
+		trainee.guess= nearest;
+	} else if (!has_nback && decision < setup.false_alarm_threshold) {
+		trainee.guess= 1 + (int)nback_rng::scale(bits, max_sim_n);
+	}
+
+	if (trainee.guess) {
+		const long long reaction_usec= sample_reaction_usec(setup, trainee.rng.next());
+		if (reaction_usec < setup.timeout_usec) {
+			trainee.send_usec= now_usec + reaction_usec;
+			if (setup.clear_on_guess) {
+				trainee.past.clear();
 			}
-			exit(EXIT_FAILURE);
-		} else if (select_result == 0) {
-			//no result
-		} else {
-			assert(FD_ISSET(STDIN_FILENO, &read_fds));
+		}
+	}
+}
 
-			fgets(buff, sizeof(buff), stdin);
-			read_len = strlen(buff) - 1;
-			if (buff[read_len] == '\n') {
-				buff[read_len] = '\0';
+// "\r* 5: " or "\r*10: " is a stimulus, "\r  5: " only takes its ping away. after the
+// first stimulus the only '!' are verdicts and "That's all!"
+void load_parse(load_trainee &trainee, const sim_setup &setup, const char *bytes, int len,
+	long long now_usec, load_stats &stats) {
+
+	for (int i= 0; i < len; ++i) {
+		const char c= bytes[i];
+
+		if (trainee.parse_state == load_trainee::parse_return && c == '*') {
+			trainee.parse_state= load_trainee::parse_value;
+			trainee.value= 0;
+			trainee.value_digits= 0;
+			continue;
+		} else if (trainee.parse_state == load_trainee::parse_value) {
+			if (c == ' ' && trainee.value_digits == 0) {
+				continue;
+			}
+			if (c >= '0' && c <= '9' && trainee.value_digits < 3) {
+				trainee.value= trainee.value*10 + (c - '0');
+				trainee.value_digits++;
+				continue;
+			}
+			if (c == ':' && trainee.value_digits > 0) {
+				load_on_stimulus(trainee, setup, now_usec, stats);
 			}
+		}
+		trainee.parse_state= load_trainee::parse_text;
 
-			result= (sscanf(buff, "%d", &out_user_guess) > 0);
+		if (c == '\r') {
+			trainee.parse_state= load_trainee::parse_return;
+		} else if (c == '!' && trainee.due_usec >= 0) {
+			// a guess that arrived after its timeout answers the next stimulus
+			// instead; its verdict still starts the pause
+			if (trainee.sent_usec >= 0) {
+				stats.verdict_latency.push_back(now_usec - trainee.sent_usec);
+				trainee.sent_usec= -1;
+			}
+			trainee.due_usec= now_usec + 2*usec_per_sec;
 		}
 	}
+}
 
-	return result;
+coro_task run_trainee_coro(coro_executor &executor, load_trainee &trainee, const sim_setup &setup, load_stats &stats) {
+	char buffer[1024];
+
+	executor.watch(trainee.watch, trainee.fd);
+	while (!executor.is_stopping() && !trainee.done) {
+		if (co_await executor.input_or_timeout(trainee.watch, trainee.send_usec)) {
+			const long long now_usec= monotonic_usec();
+			ssize_t read_result;
+			while ((read_result= read(trainee.fd, buffer, sizeof(buffer))) > 0) {
+				load_parse(trainee, setup, buffer, (int)read_result, now_usec, stats);
+			}
+			trainee.watch.ready= false;
+			// a closed socket reads 0, a pty whose game has exited fails with EIO
+			if (read_result == 0 || (read_result == -1 && errno != EAGAIN && errno != EINTR)) {
+				trainee.done= true;
+			}
+		}
+
+		if (trainee.send_usec >= 0 && monotonic_usec() >= trainee.send_usec) {
+			char line[max_int_text_len + 1];
+			const int len= format_int(line, trainee.guess);
+			line[len]= '\n';
+			if (write(trainee.fd, line, len + 1) == len + 1) {
+				trainee.sent_usec= monotonic_usec();
+				stats.guesses++;
+			}
+			trainee.send_usec= -1;
+		}
+	}
+
+	executor.unwatch(trainee.watch);
+	if (--stats.running == 0) {
+		executor.request_stop();
+	}
 }
 
-struct nback_options {
-	// modes
-	int test_mode;
-	int random_mode;
-	// settings
-	optional<int> timeout_sec;
-	int print_buffer_on_guess;
-	int clear_buffer_on_guess;
+// the game on a fresh pseudo-terminal, as a trainee would start it. returns
+// the master side, -1 on failure
+int spawn_on_pty(const nback_options &options, pid_t &out_child) {
+	const int master= posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (master == -1) {
+		return -1;
+	}
+	const char *slave_name= grantpt(master) == 0 && unlockpt(master) == 0 ? ptsname(master) : NULL;
+	if (!slave_name) {
+		close(master);
+		return -1;
+	}
 
-	void clear() {
-		test_mode= 0;
-		random_mode= 0;
-		timeout_sec= {false, 0};
-		print_buffer_on_guess= 1;
-		clear_buffer_on_guess= 0;
+	char seconds[max_int_text_len + 1];
+	seconds[format_int(seconds, get_guess_timeout_sec(options.timeout_sec))]= '\0';
+	const char *argv[9];
+	int argc= 0;
+	argv[argc++]= "nback";
+	if (options.test_mode) {
+		argv[argc++]= "--test";
+	} else if (options.random_mode) {
+		argv[argc++]= "--random";
 	}
-};
+	if (options.clear_buffer_on_guess) {
+		argv[argc++]= "--guess_clear";
+	}
+	if (options.fast_start) {
+		argv[argc++]= "--fast_start";
+	}
+	argv[argc++]= "--seconds";
+	argv[argc++]= seconds;
+	argv[argc]= NULL;
 
-void display_usage() {
-	puts("N-Back brain improvement. by: jelly   ");
-	puts("Options:                                                   ");
-	puts("  --cards          : default, shuffled deck of 40 cards  ");
-	puts("  --test           : test mode, short and predictable      ");
-	puts("  --random         : 'true random' mode. never ends     ");
-	puts("  --no_history     : disables history display on each guess");
-	puts("  --guess_reset    : resets history on each guess        ");
-	puts("  --seconds [v]    : set timeout for each guess (from 2)   ");
-	puts("  --help, -h, -?   : display this message                  ");
+	const pid_t child= fork();
+	if (child == 0) {
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		signal(SIGPIPE, SIG_DFL);
+		setsid();
+		const int slave= open(slave_name, O_RDWR);
+		if (slave == -1) {
+			_exit(127);
+		}
+		dup2(slave, STDIN_FILENO);
+		dup2(slave, STDOUT_FILENO);
+		dup2(slave, STDERR_FILENO);
+		execv("/proc/self/exe", (char *const *)argv);
+		_exit(127);
+	}
+	if (child == -1) {
+		close(master);
+		return -1;
+	}
+
+	fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+	out_child= child;
+	return master;
 }
 
-bool get_options(int argc, char *argv[], nback_options &out_options) {
-	bool success= true;
-	int getopt_code;
-	const char *const opt_string= "s:nh?";
-	int unused;
-	const struct option long_options[]= {
-		{ "cards",        no_argument,    &unused, 1 },
-		{ "test",         no_argument, &out_options.test_mode, 1 },
-		{ "random",       no_argument, &out_options.random_mode, 1 },
-		{ "no_history",   no_argument, 0, 'n' },
-		{ "guess_clear",  no_argument, &out_options.clear_buffer_on_guess, 1 },
-		{ "seconds",      required_argument, 0, 's' },
-		{ "help",         no_argument, 0, 'h' },
-		{ 0, 0, 0, 0}
-	};
+int connect_to_server(const char *path) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family= AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
 
-	out_options.clear();
+	const int fd= socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	if (connect(fd, (const sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
 
-	do {
-		int option_index= 0;
+// of an ascending vector, nearest rank: the smallest value with at least
+// percent of the samples at or below it
+long long get_percentile(const std::vector<long long> &sorted, int percent) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	const size_t rank= (sorted.size()*percent + 99)/100;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
 
-		getopt_code= getopt_long(argc, argv, opt_string, long_options, &option_index);
+// trainee_count trainees from the first stimulus to the last verdict.
+// false if a signal cut it short
+bool run_load_step(const nback_options &options, const sim_setup &setup, int trainee_count,
+	uint64_t seed, session_signals &signals, load_stats &stats, long long &out_elapsed_usec) {
 
-		switch (getopt_code) {
-			case -1:
-				break;
+	coro_executor executor;
+	if (!executor.open()) {
+		fprintf(stderr, "Cannot create event loop: %s\n", strerror(errno));
+		return false;
+	}
 
-			case 0:
-				//TODO: What is this case? seems to relate to option_index being valid
-				break;
-				
-			case 'n':
-				out_options.print_buffer_on_guess= 0;
-				break;
+	std::vector<load_trainee> trainees(trainee_count);
+	const long long start_usec= monotonic_usec();
 
-			case 's':
-				if (sscanf(optarg, "%d", &out_options.timeout_sec.value) != 0) {
-					out_options.timeout_sec.is_set= true;
-				} else {
-					puts("Option '-s' requires an integer value.");
-					success= false;
-				}
-				break;
+	for (int i= 0; i < trainee_count; ++i) {
+		load_trainee &trainee= trainees[i];
+		trainee.child= -1;
+		trainee.fd= options.load_socket_path
+			? connect_to_server(options.load_socket_path)
+			: spawn_on_pty(options, trainee.child);
+		if (trainee.fd == -1) {
+			stats.failed++;
+			continue;
+		}
+		trainee.rng.reseed(get_session_seed(seed, i));
+		trainee.parse_state= load_trainee::parse_text;
+		trainee.due_usec= -1;
+		trainee.send_usec= -1;
+		trainee.sent_usec= -1;
+		trainee.done= false;
+		stats.running++;
+		executor.spawn(run_trainee_coro(executor, trainee, setup, stats));
+	}
+	if (stats.running > 0 && signals.get_fd() != -1) {
+		executor.spawn(watch_signals_coro(executor, signals));
+	}
+	executor.run();
+	out_elapsed_usec= monotonic_usec() - start_usec;
 
-			case 'h':
-			case '?':
-				success= false;
-				break;
+	// a game still running sees its terminal hang up
+	for (int i= 0; i < trainee_count; ++i) {
+		if (trainees[i].fd != -1) {
+			close(trainees[i].fd);
+		}
+	}
+	for (int i= 0; i < trainee_count; ++i) {
+		if (trainees[i].child > 0) {
+			waitpid(trainees[i].child, NULL, 0);
+		}
+	}
+	return !signals.is_shutdown_requested();
+}
 
-			default:
-				abort ();
+void print_load_step(int trainee_count, load_stats &stats, long long elapsed_usec) {
+	std::sort(stats.verdict_latency.begin(), stats.verdict_latency.end());
+	printf("%8d %10.1f %8lld %8lld %8lld %8lld %8lld %8.1f %8.1f %8lld %6lld\n",
+		trainee_count,
+		elapsed_usec > 0 ? stats.stimuli*(double)usec_per_sec/elapsed_usec : 0.0,
+		(long long)stats.verdict_latency.size(),
+		get_percentile(stats.verdict_latency, 50),
+		get_percentile(stats.verdict_latency, 90),
+		get_percentile(stats.verdict_latency, 99),
+		stats.verdict_latency.empty() ? 0 : stats.verdict_latency.back(),
+		stats.onset_lateness.get_mean(), stats.onset_lateness.get_stddev(),
+		stats.onset_lateness.samples ? stats.onset_lateness.max_usec : 0,
+		stats.failed);
+	fflush(stdout);
+}
+
+// with --load_ramp k, k steps of n/k, 2n/k .. n trainees. one table row each
+int run_load_generator(const nback_options &options) {
+	sim_setup setup;
+	session_signals signals;
+
+	prepare_sim_setup(setup, options, options.player);
+	// every trainee holds a descriptor, a pty game one more
+	raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+	signals.open();
+
+	printf("load on %s, up to %d trainees in %d steps\n",
+		options.load_socket_path ? options.load_socket_path : "ptys",
+		options.load_trainees, options.load_steps);
+	printf("%8s %10s %8s %8s %8s %8s %8s %8s %8s %8s %6s\n",
+		"trainees", "stimuli/s", "verdicts", "p50", "p90", "p99", "max",
+		"late", "jitter", "late max", "failed");
+
+	for (int step= 1; step <= options.load_steps; ++step) {
+		const int trainee_count= std::max(1, options.load_trainees*step/options.load_steps);
+		load_stats stats;
+		long long elapsed_usec= 0;
+
+		stats.clear();
+		const bool finished= run_load_step(options, setup, trainee_count,
+			nback_rng::mix(options.seed + step), signals, stats, elapsed_usec);
+		print_load_step(trainee_count, stats, elapsed_usec);
+		if (!finished) {
+			break;
 		}
-	} while (getopt_code != -1);
+	}
+	puts("verdict latency and onset lateness in usec");
 
-	return success;
+	signals.close();
+	return 0;
 }
+#endif // NBACK_HAS_COROUTINES
 
 // Entry point
-value_provider_factory factory;
-
-struct nback_results {
-	int correct;
-	int incorrect;
-	int incorrect_no_nback;
-	int misses;
-};
 
 int main(int argc, char *argv[]) {
 
-	nback_results res= {0};
-	n_back_buffer past;
+	session_arena arena;
 	i_nback_value_provider *prov= 0;
 
 	// Setup
+#ifdef NBACK_UNIT_TESTS
+	// the test build only runs the self-tests
 	run_unit_tests_ring_t();
-	srand(time(0));
+	run_unit_tests_text_ring_t();
+	run_unit_tests_occurrence_history();
+	run_unit_tests_sim_lanes();
+	puts("self-tests passed");
+	return 0;
+#endif // NBACK_UNIT_TESTS
+	game_rng.reseed(time(0));
 	
 	// Options
 	nback_options options;
@@ -568,78 +6414,162 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-#ifdef TEST_VALUE_PROVIDER_FACTORY_ASSERT
-	if (true) {
-		prov= factory.create<test_static_assert_value_provider>();
-	} else
-#endif // TEST_VALUE_PROVIDER_FACTORY_ASSERT
-	if (options.test_mode) {
-		prov= factory.create<test_value_provider>();
-	} else if (options.random_mode) {
-		prov= factory.create<random_value_provider>();
-	} else {
-		prov= factory.create<card_value_provider>();
+	if (options.bench_render_trials.is_set) {
+		run_render_benchmark(options.bench_render_trials.value);
+		return 0;
 	}
 
-	puts("N-back is training for your brain.");
-	puts("Numbers are presented in sequence,");
-	puts("  and it's your job to identify");
-	puts("  how far (n) back that number");
-	printf("  last appeared, to a max of %d.\n",
-		n_back_buffer::my_size-1);
-	sleep(1);
-	
-	puts("Here we go!");
-	sleep(1);
+	if (options.bench_startup_runs.is_set) {
+		run_startup_benchmark(options.bench_startup_runs.value, options.fast_start != 0);
+		return 0;
+	}
 
-	while (prov->has_next()) {
-		optional<int> guess_back;
-		int has_nback;
-		int current_value= prov->get_next_value();
+	// the simulation, coroutine and load generator histories are fixed
+	const bool fixed_max_n= options.simulate_sessions.is_set || options.coro_mode || options.load_trainees > 0
+		|| (options.serve_path && options.prefork_workers == 0);
+	if (fixed_max_n && options.max_n != n_back_buffer::my_size - 1) {
+		fprintf(stderr, "--max_n applies to terminal, prefork and headless sessions, using %d\n",
+			n_back_buffer::my_size - 1);
+		// the decks too are dealt for that depth
+		options.max_n= n_back_buffer::my_size - 1;
+	}
+
+	if (options.simulate_sessions.is_set) {
+		sim_setup setup;
+		sim_stats stats;
 
-		if (past.is_full()) {
-			past.dequeue();
+		prepare_sim_setup(setup, options, options.player);
+		setup.lane_kernel= find_sim_lane_kernel(options.sim_kernel);
+		if (!setup.lane_kernel) {
+			printf("Simulation kernel '%s' is not available on this cpu.\n", options.sim_kernel);
+			return 1;
 		}
+		stats.clear();
 
-		past.enqueue(current_value);
-		
-		has_nback= nback_has_back(past);
-		
-		guess_back.is_set= try_get_guess_with_timeout(current_value, options.timeout_sec, guess_back.value);
+		const int thread_count= options.sim_threads > 0
+			? options.sim_threads : sim_thread_pool::get_default_thread_count();
+		sim_thread_pool pool(setup, thread_count);
 
-		if (guess_back.is_set) {
-			if (options.print_buffer_on_guess) {
-				print_n_back_buffer(past);
-			}
+		const long long start_usec= monotonic_usec();
+		if (!pool.run(options.simulate_sessions.value, stats)) {
+			fprintf(stderr, "Cannot map simulation memory: %s\n", strerror(errno));
+			return 1;
+		}
+		print_sim_stats(stats, monotonic_usec() - start_usec);
+		printf("threads: %d, steals: %lld\n", thread_count, pool.get_steals());
+		printf("session memory: %s pages, heap allocations while simulating: %lld\n",
+			pool.get_arena_pages_name(), stats.heap_allocations);
+		if (setup.use_bank) {
+			printf("lane kernel: %s\n", setup.lane_kernel->name);
+		}
+		return 0;
+	}
 
-			if (nback_is_guess_correct(past, guess_back.value)) {
-				puts("correct! resuming...");
-				res.correct++;
-			} else {
-				puts("wrong! resuming...");
-				if (has_nback) {
-					res.incorrect++;
-				} else {
-					res.incorrect_no_nback++;
-				}
-			}
+	if (options.load_trainees > 0) {
+#ifdef NBACK_HAS_COROUTINES
+		return run_load_generator(options);
+#else
+		fputs("--load needs a C++20 build (coroutines)\n", stderr);
+		return 1;
+#endif // NBACK_HAS_COROUTINES
+	}
 
-			if (options.clear_buffer_on_guess) {
-				past.clear();
-			}
-			sleep(2);
-		} else {
-			// todo: should misses count all nbacks, regardless of whether past is cleared?
-			res.misses+= has_nback ? 1 : 0;
+	// the provider, history, script line and log ring of this session
+	if (!arena.open(event_log::get_arena_size() + session_arena_slack, false)) {
+		fprintf(stderr, "Cannot map session memory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	event_log log;
+	if (options.log_path
+		&& !log.open(options.log_path, options.log_binary ? event_log::format_binary : event_log::format_json, arena)) {
+		fprintf(stderr, "Cannot open log '%s': %s\n", options.log_path, strerror(errno));
+		return 1;
+	}
+
+	if (options.headless_mode) {
+		FILE *script= options.headless_script
+			? fopen(options.headless_script, "r")
+			: fdopen(options.headless_fd.is_set ? options.headless_fd.value : STDIN_FILENO, "r");
+
+		if (!script) {
+			fprintf(stderr, "Cannot open headless input: %s\n", strerror(errno));
+			return 1;
+		}
+
+		const headless_summary summary= run_headless_session(options, script, log.is_open() ? &log : NULL, arena);
+		log.close();
+		report_dropped_log_records(log);
+		fclose(script);
+		if (summary.out_of_memory) {
+			return 1;
 		}
+		print_headless_summary(STDOUT_FILENO, get_mode_name(options), summary);
+		return 0;
 	}
 
-	puts("... That's all!");
-	
-	printf("correct: %d\n", res.correct);
-	printf("incorrect (w/ nback): %d\n", res.incorrect);
-	printf("incorrect (w/ no nback): %d\n", res.incorrect_no_nback);
-	printf("missed: %d\n", res.misses);
+	if (options.serve_path && options.prefork_workers > 0) {
+		if (log.is_open()) {
+			fputs("--log records one process, ignored with --prefork\n", stderr);
+			log.close();
+		}
+		return run_prefork_server(options, options.serve_path, arena);
+	}
 
-	return 0;
+	if (options.serve_path) {
+#ifdef NBACK_HAS_COROUTINES
+		const int result= run_session_server(options, options.serve_path, log.is_open() ? &log : NULL);
+		log.close();
+		report_dropped_log_records(log);
+		return result;
+#else
+		fputs("--serve needs a C++20 build (coroutines)\n", stderr);
+		return 1;
+#endif // NBACK_HAS_COROUTINES
+	}
+
+	if (options.coro_mode) {
+#ifdef NBACK_HAS_COROUTINES
+		coro_executor executor;
+		session_signals coro_signals;
+		coro_session session(&options, STDIN_FILENO, STDOUT_FILENO);
+		session.stop_executor_on_end= true;
+		session.log= log.is_open() ? &log : NULL;
+
+		if (!executor.open()) {
+			fprintf(stderr, "Cannot create event loop: %s\n", strerror(errno));
+			return 1;
+		}
+		if (coro_signals.open()) {
+			executor.spawn(watch_signals_coro(executor, coro_signals));
+		}
+		executor.spawn(run_session_coro(executor, session));
+		executor.run();
+		log.close();
+		report_dropped_log_records(log);
+		return 0;
+#else
+		fputs("--coro needs a C++20 build (coroutines)\n", stderr);
+		return 1;
+#endif // NBACK_HAS_COROUTINES
+	}
+
+	guess_reader input(STDIN_FILENO);
+	session_signals signals;
+	if (!signals.open()) {
+		fprintf(stderr, "signalfd unavailable (%s), signals end the session abruptly\n", strerror(errno));
+	}
+	if (options.realtime_mode) {
+		enter_realtime_mode(options.realtime_cpu, options.realtime_fifo != 0);
+	}
+
+	prov= create_value_provider(arena, options, game_rng);
+	const bool played= run_terminal_session(options, prov, arena, input, signals, log.is_open() ? &log : NULL);
+
+	fflush(stdout);
+	log.close();
+	report_dropped_log_records(log);
+	signals.close();
+
+	return played ? 0 : 1;
 }
\ No newline at end of file